@@ -0,0 +1,497 @@
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING 1
+#endif
+// <linux/fs.h> (pulled in by io_uring.h) has its own BLOCK_SIZE; the one that
+// matters here is raw_disk.h's, so drop the kernel's before including it
+#undef BLOCK_SIZE
+#endif
+#endif
+
+#include "async_io.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+// number of submission queue entries in the ring
+#define ASYNC_QUEUE_DEPTH 64
+
+// number of worker threads when io_uring isn't available
+#define ASYNC_NUM_THREADS 4
+
+// most blocks merged into one vectored request
+#define ASYNC_MAX_RUN 256
+
+
+// one queued block
+struct request {
+  block_num_t block_num;
+  void* buf;
+  int is_write;
+  int seq;     // queue order, keeps the sort stable
+  int round;   // earlier requests for the same block in this batch
+};
+
+// one vectored request covering a run of adjacent blocks
+struct op {
+  int is_write;
+  off_t offset;
+  struct iovec* iov;
+  int nvec;
+};
+
+static int disk_fd = -1;
+static int using_uring = 0;
+
+// Each thread queues its own requests.  Only one batch at a time goes
+// through the engine; a thread that finds it busy does its batch itself.
+static __thread struct request* pending = NULL;
+static __thread int num_pending = 0;
+static __thread int pending_capacity = 0;
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int do_op(struct op* op) {
+  ssize_t ret = op->is_write ? pwritev(disk_fd, op->iov, op->nvec, op->offset)
+                             : preadv(disk_fd, op->iov, op->nvec, op->offset);
+  return ret == (ssize_t)op->nvec * BLOCK_SIZE ? 0 : -1;
+}
+
+
+/********************************* io_uring *********************************/
+#ifdef HAVE_IO_URING
+
+static struct {
+  int fd;
+  unsigned sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  void* sq_ptr;
+  size_t sq_size;
+  void* cq_ptr;
+  size_t cq_size;
+  size_t sqes_size;
+} ring = { .fd = -1 };
+
+
+static void uring_stop() {
+  if (ring.sqes != NULL) {
+    munmap(ring.sqes, ring.sqes_size);
+  }
+  if (ring.cq_ptr != NULL && ring.cq_ptr != ring.sq_ptr) {
+    munmap(ring.cq_ptr, ring.cq_size);
+  }
+  if (ring.sq_ptr != NULL) {
+    munmap(ring.sq_ptr, ring.sq_size);
+  }
+  if (ring.fd >= 0) {
+    close(ring.fd);
+  }
+  memset(&ring, 0, sizeof(ring));
+  ring.fd = -1;
+}
+
+
+static int uring_start() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring.fd = syscall(__NR_io_uring_setup, ASYNC_QUEUE_DEPTH, &params);
+  if (ring.fd < 0) {
+    // no io_uring in this kernel (or it's been disabled)
+    ring.fd = -1;
+    return -1;
+  }
+
+  // map the submission ring, the completion ring and the SQE array
+  ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && ring.cq_size > ring.sq_size) {
+    ring.sq_size = ring.cq_size;
+  }
+
+  ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  if (ring.sq_ptr == MAP_FAILED) {
+    ring.sq_ptr = NULL;
+    uring_stop();
+    return -1;
+  }
+  if (single_mmap) {
+    ring.cq_ptr = ring.sq_ptr;
+  } else {
+    ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    if (ring.cq_ptr == MAP_FAILED) {
+      ring.cq_ptr = NULL;
+      uring_stop();
+      return -1;
+    }
+  }
+  ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED) {
+    ring.sqes = NULL;
+    uring_stop();
+    return -1;
+  }
+
+  char* sq = ring.sq_ptr;
+  char* cq = ring.cq_ptr;
+  ring.sq_entries = params.sq_entries;
+  ring.sq_head = (unsigned*)(sq + params.sq_off.head);
+  ring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned*)(sq + params.sq_off.array);
+  ring.cq_head = (unsigned*)(cq + params.cq_off.head);
+  ring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return 0;
+}
+
+
+/* uring_run
+ *   pushes the ops through the ring, keeping up to a full ring in flight, and
+ *   reaps completions until every op is done.  If the ring stops taking ops,
+ *   the rest aren't submitted, but the ones the kernel has are still waited
+ *   for, since their buffers are freed once this returns.
+ */
+static int uring_run(struct op* ops, int num_ops) {
+  int next = 0;
+  unsigned queued = 0;     // in the submission ring, not yet taken by the kernel
+  unsigned in_flight = 0;  // taken by the kernel, not yet completed
+  int failed = 0;
+
+  while (next < num_ops || queued > 0 || in_flight > 0) {
+    // fill the free submission slots
+    unsigned tail = *ring.sq_tail;
+    while (next < num_ops && in_flight + queued < ring.sq_entries) {
+      unsigned index = tail & *ring.sq_mask;
+      struct io_uring_sqe* sqe = &ring.sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = ops[next].is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->fd = disk_fd;
+      sqe->off = ops[next].offset;
+      sqe->addr = (uint64_t)(uintptr_t)ops[next].iov;
+      sqe->len = ops[next].nvec;
+      sqe->user_data = next;
+      ring.sq_array[index] = index;
+      tail++;
+      queued++;
+      next++;
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    // submit the batch and wait for at least one completion
+    int ret;
+    do {
+      ret = syscall(__NR_io_uring_enter, ring.fd, queued, 1,
+                    IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+      // take back whatever the kernel didn't accept and drain the rest
+      unsigned sq_head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+      in_flight += queued - (tail - sq_head);
+      __atomic_store_n(ring.sq_tail, sq_head, __ATOMIC_RELEASE);
+      queued = 0;
+      next = num_ops;
+      failed = 1;
+    } else {
+      queued -= ret;
+      in_flight += ret;
+    }
+
+    // reap everything that has completed
+    unsigned head = *ring.cq_head;
+    unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != cq_tail) {
+      struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+      struct op* op = &ops[cqe->user_data];
+      if (cqe->res != (int32_t)(op->nvec * BLOCK_SIZE)) {
+        failed = 1;
+      }
+      in_flight--;
+      head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  return failed ? -1 : 0;
+}
+
+#endif // HAVE_IO_URING
+
+
+/******************************* thread pool *******************************/
+
+static pthread_t workers[ASYNC_NUM_THREADS];
+static int num_workers = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+
+// the batch being worked on; guarded by pool_lock
+static struct op* pool_ops = NULL;
+static int pool_num_ops = 0;
+static int pool_next = 0;
+static int pool_finished = 0;
+static int pool_failed = 0;
+static int pool_stopping = 0;
+
+
+static void* worker_main(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&pool_lock);
+  while (1) {
+    while (!pool_stopping && pool_next >= pool_num_ops) {
+      pthread_cond_wait(&work_ready, &pool_lock);
+    }
+    if (pool_stopping) {
+      break;
+    }
+    struct op* op = &pool_ops[pool_next++];
+
+    pthread_mutex_unlock(&pool_lock);
+    int ret = do_op(op);
+    pthread_mutex_lock(&pool_lock);
+
+    if (ret < 0) {
+      pool_failed = 1;
+    }
+    if (++pool_finished == pool_num_ops) {
+      pthread_cond_signal(&work_done);
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+
+static void pool_stop() {
+  pthread_mutex_lock(&pool_lock);
+  pool_stopping = 1;
+  pthread_cond_broadcast(&work_ready);
+  pthread_mutex_unlock(&pool_lock);
+  for (int i = 0; i < num_workers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  num_workers = 0;
+  pool_stopping = 0;
+  pool_ops = NULL;
+  pool_num_ops = pool_next = pool_finished = 0;
+}
+
+
+static int pool_start() {
+  for (int i = 0; i < ASYNC_NUM_THREADS; i++) {
+    if (pthread_create(&workers[num_workers], NULL, worker_main, NULL) != 0) {
+      break;
+    }
+    num_workers++;
+  }
+  if (num_workers == 0) {
+    return -1;
+  }
+  return 0;
+}
+
+
+// hands the ops to the workers and waits until they've all been done
+static int pool_run(struct op* ops, int num_ops) {
+  pthread_mutex_lock(&pool_lock);
+  pool_ops = ops;
+  pool_num_ops = num_ops;
+  pool_next = 0;
+  pool_finished = 0;
+  pool_failed = 0;
+  pthread_cond_broadcast(&work_ready);
+  while (pool_finished < pool_num_ops) {
+    pthread_cond_wait(&work_done, &pool_lock);
+  }
+  int failed = pool_failed;
+  pthread_mutex_unlock(&pool_lock);
+  return failed ? -1 : 0;
+}
+
+
+/********************************* queueing *********************************/
+
+// orders requests by block, then queue order
+static int compare_requests(const void* a, const void* b) {
+  const struct request* ra = a;
+  const struct request* rb = b;
+  if (ra->block_num != rb->block_num) {
+    return (ra->block_num > rb->block_num) - (ra->block_num < rb->block_num);
+  }
+  return ra->seq - rb->seq;
+}
+
+
+int async_start(int fd, enum raw_async_engine engine) {
+  disk_fd = fd;
+  using_uring = 0;
+#ifdef HAVE_IO_URING
+  if (engine == RAW_ASYNC_AUTO && uring_start() == 0) {
+    using_uring = 1;
+    return 0;
+  }
+#else
+  (void)engine;
+#endif
+  return pool_start();
+}
+
+
+int async_uses_uring() {
+  return using_uring;
+}
+
+
+int async_queue(block_num_t block_num, void* buf, int is_write) {
+  if (num_pending == pending_capacity) {
+    int new_capacity = pending_capacity ? 2 * pending_capacity : ASYNC_QUEUE_DEPTH;
+    struct request* grown = realloc(pending, new_capacity * sizeof(struct request));
+    if (grown == NULL) {
+      return -1;
+    }
+    pending = grown;
+    pending_capacity = new_capacity;
+  }
+  pending[num_pending].block_num = block_num;
+  pending[num_pending].buf = buf;
+  pending[num_pending].is_write = is_write;
+  pending[num_pending].seq = num_pending;
+  num_pending++;
+  return 0;
+}
+
+
+/* run_ops
+ *   runs a set of ops that touch different blocks, through the engine if
+ *   the caller holds it, otherwise one after another on this thread
+ */
+static int run_ops(struct op* ops, int num_ops, int have_engine) {
+  if (!have_engine) {
+    int ret = 0;
+    for (int i = 0; i < num_ops; i++) {
+      if (do_op(&ops[i]) < 0) {
+        ret = -1;
+      }
+    }
+    return ret;
+  }
+#ifdef HAVE_IO_URING
+  if (using_uring) {
+    return uring_run(ops, num_ops);
+  }
+#endif
+  return pool_run(ops, num_ops);
+}
+
+
+int async_wait_all() {
+  if (num_pending == 0) {
+    return 0;
+  }
+
+  // sort so adjacent blocks end up next to each other.  Requests for the
+  // same block can't be in flight together, or a read could miss the write
+  // queued before it; the n-th request for a block goes in round n, and the
+  // rounds run one after another.
+  qsort(pending, num_pending, sizeof(struct request), compare_requests);
+  int num_rounds = 1;
+  for (int i = 0; i < num_pending; i++) {
+    pending[i].round = 0;
+    if (i > 0 && pending[i].block_num == pending[i - 1].block_num) {
+      pending[i].round = pending[i - 1].round + 1;
+      if (pending[i].round == num_rounds) {
+        num_rounds++;
+      }
+    }
+  }
+
+  struct iovec* iov = malloc(num_pending * sizeof(struct iovec));
+  struct op* ops = malloc(num_pending * sizeof(struct op));
+  if (iov == NULL || ops == NULL) {
+    free(iov);
+    free(ops);
+    num_pending = 0;
+    return -1;
+  }
+
+  // another thread's batch may have the engine; don't queue up behind it
+  int have_engine = pthread_mutex_trylock(&engine_lock) == 0;
+  int ret = 0;
+  int num_iov = 0;
+  for (int round = 0; round < num_rounds; round++) {
+    // merge the round's runs of adjacent blocks
+    int num_ops = 0;
+    struct request* last = NULL;
+    for (int i = 0; i < num_pending; i++) {
+      if (pending[i].round != round) {
+        continue;
+      }
+      struct op* prev = num_ops ? &ops[num_ops - 1] : NULL;
+      iov[num_iov].iov_base = pending[i].buf;
+      iov[num_iov].iov_len = BLOCK_SIZE;
+      if (prev != NULL && prev->is_write == pending[i].is_write &&
+          prev->nvec < ASYNC_MAX_RUN &&
+          pending[i].block_num == last->block_num + 1) {
+        // extends the previous run
+        prev->nvec++;
+      } else {
+        ops[num_ops].is_write = pending[i].is_write;
+        ops[num_ops].offset = (off_t)pending[i].block_num * BLOCK_SIZE;
+        ops[num_ops].iov = &iov[num_iov];
+        ops[num_ops].nvec = 1;
+        num_ops++;
+      }
+      num_iov++;
+      last = &pending[i];
+    }
+    if (run_ops(ops, num_ops, have_engine) < 0) {
+      ret = -1;
+    }
+  }
+  if (have_engine) {
+    pthread_mutex_unlock(&engine_lock);
+  }
+
+  free(iov);
+  free(ops);
+  // (the queue goes too, so threads that stop using the disk don't keep one)
+  free(pending);
+  pending = NULL;
+  num_pending = pending_capacity = 0;
+  return ret;
+}
+
+
+void async_stop() {
+  async_wait_all();
+#ifdef HAVE_IO_URING
+  if (using_uring) {
+    uring_stop();
+  } else
+#endif
+  {
+    pool_stop();
+  }
+  using_uring = 0;
+  free(pending);
+  pending = NULL;
+  num_pending = pending_capacity = 0;
+  disk_fd = -1;
+}
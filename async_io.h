@@ -0,0 +1,45 @@
+#ifndef _ASYNC_IO_H_
+#define _ASYNC_IO_H_
+
+#include "raw_disk.h"
+
+// Asynchronous block I/O engine used by raw_disk.c.  Requests are queued with
+// async_queue() and only leave for the disk in async_wait_all(), which merges
+// runs of adjacent blocks into vectored requests, keeps as many of them in
+// flight as the engine allows and waits for every one to complete.  The
+// engine is io_uring when the kernel provides it, otherwise a small pool of
+// threads doing preadv/pwritev.  Every thread has a queue of its own, and
+// async_wait_all() only waits for the calling thread's requests.
+
+/* async_start
+ *   starts an engine for the given file descriptor
+ * returns 0 on success or -1 if no engine could be started
+ */
+int async_start(int fd, enum raw_async_engine engine);
+
+/* async_uses_uring
+ *   returns 1 if the running engine is io_uring, 0 if it is the thread pool
+ */
+int async_uses_uring();
+
+/* async_queue
+ *   queues a read or write of one block; buf must stay valid (and, for a
+ *   write, unchanged) until the next async_wait_all()
+ * returns 0 on success or -1 on failure
+ */
+int async_queue(block_num_t block_num, void* buf, int is_write);
+
+/* async_wait_all
+ *   submits everything queued and waits until all of it has completed;
+ *   requests for the same block are done one at a time, in queue order
+ * returns 0 if every request succeeded or -1 if any of them failed
+ */
+int async_wait_all();
+
+/* async_stop
+ *   waits for the calling thread's outstanding requests and shuts the
+ *   engine down (no other thread may be using it)
+ */
+void async_stop();
+
+#endif // _ASYNC_IO_H_
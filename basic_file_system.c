@@ -1,85 +1,844 @@
 #include "basic_file_system.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// number of allocation bits held by one bitmap block
+#define BITS_PER_BITMAP_BLOCK (8 * BLOCK_SIZE)
+
+// allocate_block() searches the bitmap 64 bits at a time
+#define WORDS_PER_BITMAP_BLOCK (BLOCK_SIZE / sizeof(uint64_t))
+
+// bfs_mkfs() gives a 32nd of the disk to the journal, up to a maximum; but a
+// transaction may hold the whole bitmap and the superblock, so the journal
+// always has room for those and this many more blocks (a disk that would
+// need more than an 8th of itself for that gets no journal)
+#define MAX_JOURNAL_BLOCKS 2048
+#define JOURNAL_MIN_ROOM 64
+
+// layout of the mounted disk (made up for legacy disks, which have no
+// superblock: their bitmap is block 0 and their root directory is block 1)
+static struct superblock sb;
+
+// The whole free bitmap, loaded at mount time.  allocate_block() and
+// release_block() only change this copy; changed bitmap blocks are written
+// straight to the disk (they never go through the block cache) by
+// flush_free_space().
+static char* bitmap = NULL;
+static char* bitmap_dirty = NULL; // one flag per bitmap block
+static unsigned bitmap_changes = 0; // allocations and releases since the last flush
+static unsigned flush_interval = 0; // see bfs_set_flush_interval()
+
+// number of free blocks tracked by each bitmap block, so allocate_block()
+// can skip full ones without looking at them
+static uint32_t* free_counts = NULL;
+
+// allocate_block() starts searching here (next fit), so it doesn't rescan
+// the allocated blocks at the start of the disk every time
+static block_num_t next_fit = 0;
+
+// running total of free_counts, kept in the superblock as well
+static uint32_t total_free = 0;
+
+// number of files and directories, if known (see bfs_inode_count_known())
+static uint32_t num_inodes = 0;
+static int inode_count_known = 0;
+
+// whether directories record their parent (see bfs_dir_parents_known())
+static int dir_parents_known = 0;
+
+// Whether the mounted disk has a journal.  If it does, changes only reach
+// the disk through commit(), and blocks released since the last commit are
+// held back (their bits stay set, and in held) until the next one, since
+// the disk may still be using them if it crashes before then.
+static int journaled = 0;
+static char* held = NULL;
+static block_num_t* pending = NULL; // the held blocks
+static size_t num_pending = 0;
+static size_t pending_capacity = 0;
+
+// see bfs_set_commit_interval() / bfs_commit_point()
+static unsigned commit_interval = BFS_DEFAULT_COMMIT_INTERVAL;
+static int window_open = 0;
+static uint64_t window_start = 0; // in milliseconds
+
+// see bfs_begin_batch()
+static int in_batch = 0;
+
+
+// returns the index-th 64-bit word of the in-memory bitmap; bit k of it is
+// block 64 * index + k, whatever the byte order of the machine
+static inline uint64_t bitmap_word(size_t index) {
+  uint64_t word;
+  memcpy(&word, bitmap + index * sizeof(uint64_t), sizeof(word));
+  return le64toh(word);
+}
+
+
+// sets bits [from, to) of a bitmap block (to is capped at the block's end)
+static void set_bits(char* bitmap, uint64_t from, uint64_t to) {
+  if (to > BITS_PER_BITMAP_BLOCK) {
+    to = BITS_PER_BITMAP_BLOCK;
+  }
+  for (uint64_t bit = from; bit < to; bit++) {
+    bitmap[bit / 8] |= 1 << (bit % 8);
+  }
+}
+
+
+int bfs_mkfs(const char* filename, uint32_t block_size, uint32_t num_blocks) {
+  // create the file and its format header
+  if (raw_format(filename, block_size, num_blocks) < 0) {
+    return -1;
+  }
+  if (raw_mount(filename) < 0) {
+    return -1;
+  }
+
+  // lay out the superblock, then the bitmap, then the root directory
+  // (64-bit math: num_blocks can be as large as UINT32_MAX)
+  uint64_t bits_per_block = 8 * (uint64_t)block_size;
+  uint32_t bitmap_blocks = (num_blocks + bits_per_block - 1) / bits_per_block;
+  uint32_t journal_blocks = num_blocks / 32;
+  if (journal_blocks > MAX_JOURNAL_BLOCKS) {
+    journal_blocks = MAX_JOURNAL_BLOCKS;
+  }
+  uint32_t least = journal_blocks_for((uint64_t)bitmap_blocks + 1 + JOURNAL_MIN_ROOM);
+  if (journal_blocks < least) {
+    journal_blocks = least;
+  }
+  if (journal_blocks > num_blocks / 8) {
+    journal_blocks = 0;
+  }
+  uint64_t root_block = 1 + (uint64_t)bitmap_blocks + journal_blocks;
+  if (root_block >= num_blocks) {
+    // too small to hold the root directory
+    raw_unmount();
+    return -1;
+  }
+
+  char block[BLOCK_SIZE];
+  if (read_block(0, block) < 0) {
+    raw_unmount();
+    return -1;
+  }
+  struct superblock* new_sb = (struct superblock*)block;
+  new_sb->bitmap_start = 1;
+  new_sb->bitmap_blocks = bitmap_blocks;
+  new_sb->root_block = root_block;
+  new_sb->free_blocks = num_blocks - (root_block + 1);
+  new_sb->num_inodes = 1; // the root directory
+  new_sb->flags = SB_HAS_INODE_COUNT | SB_HAS_DIR_PARENTS;
+  new_sb->journal_start = journal_blocks != 0 ? 1 + bitmap_blocks : 0;
+  new_sb->journal_blocks = journal_blocks;
+  if (write_block(0, block) < 0) {
+    raw_unmount();
+    return -1;
+  }
+
+  // everything up to the root directory is in use, and so are the bits for
+  // blocks past the end of the disk, so they can never be allocated; only
+  // the first and last bitmap blocks have any of those bits
+  for (uint32_t i = 0; i < bitmap_blocks; i++) {
+    uint64_t first = i * bits_per_block;
+    memset(block, 0, BLOCK_SIZE);
+    set_bits(block, 0, root_block + 1 > first ? root_block + 1 - first : 0);
+    set_bits(block, num_blocks > first ? num_blocks - first : 0, bits_per_block);
+    if (write_block(1 + i, block) < 0) {
+      raw_unmount();
+      return -1;
+    }
+  }
+
+  // the root directory block is already all 0's, i.e. an empty directory,
+  // and the journal is empty
+  return raw_unmount();
+}
+
+
+static int commit();
 
 
 int bfs_mount(const char* filename) {
+  // a missing or empty file gets a new file system with the default geometry
+  struct stat st;
+  int missing = stat(filename, &st) < 0 && errno == ENOENT;
+  if (missing || (!missing && st.st_size == 0)) {
+    if (bfs_mkfs(filename, DEFAULT_BLOCK_SIZE, DEFAULT_NUM_BLOCKS) < 0) {
+      return -1;
+    }
+  }
+
   // mount the raw disk
   if (raw_mount(filename) < 0) {
     return -1;
   }
 
-  // read the superblock
-  char superblock[BLOCK_SIZE];
-  if (read_block(0, superblock) < 0) {
+  // put the block cache in front of it
+  if (cache_init() < 0) {
+    raw_unmount();
     return -1;
   }
 
-  // make sure the superblock and root directory are marked "allocated"
-  if (!(superblock[0] & 3)) {
-    superblock[0] |= 3;
-    if (write_block(0, superblock) < 0) {
+  if (raw_is_legacy()) {
+    memset(&sb, 0, sizeof(sb));
+    sb.bitmap_start = 0;
+    sb.bitmap_blocks = 1;
+    sb.root_block = 1;
+  } else {
+    // read the superblock and sanity check the layout it describes
+    char superblock[BLOCK_SIZE];
+    if (read_block(0, superblock) < 0) {
+      bfs_unmount();
+      return -1;
+    }
+    memcpy(&sb, superblock, sizeof(sb));
+    if (sb.bitmap_start == 0 ||
+        (uint64_t)sb.bitmap_blocks * BITS_PER_BITMAP_BLOCK < NUM_BLOCKS ||
+        sb.root_block >= NUM_BLOCKS ||
+        (sb.journal_blocks != 0 &&
+         (sb.journal_start < sb.bitmap_start + sb.bitmap_blocks ||
+          (uint64_t)sb.journal_start + sb.journal_blocks > sb.root_block))) {
+      bfs_unmount();
       return -1;
     }
+
+    // finish a commit that a crash cut short before reading anything else
+    // (it may have been writing the superblock itself)
+    if (sb.journal_blocks != 0) {
+      if (journal_open(sb.journal_start, sb.journal_blocks) < 0 ||
+          read_block(0, superblock) < 0) {
+        bfs_unmount();
+        return -1;
+      }
+      memcpy(&sb, superblock, sizeof(sb));
+    }
+  }
+
+  // load the whole bitmap with one batched read
+  bitmap = malloc((size_t)sb.bitmap_blocks * BLOCK_SIZE);
+  bitmap_dirty = calloc(sb.bitmap_blocks, 1);
+  block_num_t* block_nums = malloc(sb.bitmap_blocks * sizeof(block_num_t));
+  void** bufs = malloc(sb.bitmap_blocks * sizeof(void*));
+  int ret = -1;
+  if (bitmap != NULL && bitmap_dirty != NULL && block_nums != NULL && bufs != NULL) {
+    for (uint32_t i = 0; i < sb.bitmap_blocks; i++) {
+      block_nums[i] = sb.bitmap_start + i;
+      bufs[i] = bitmap + (size_t)i * BLOCK_SIZE;
+    }
+    ret = read_blocks(block_nums, bufs, sb.bitmap_blocks);
+  }
+  free(block_nums);
+  free(bufs);
+  if (ret < 0) {
+    bfs_unmount();
+    return -1;
+  }
+  bitmap_changes = 0;
+  total_free = 0;
+
+  // make sure the superblock and root directory of a legacy disk are marked
+  // "allocated"
+  if (raw_is_legacy() && (bitmap[0] & 3) != 3) {
+    bitmap[0] |= 3;
+    bitmap_dirty[0] = 1;
+  }
+
+  // the bits past the end of the disk must never look free
+  for (uint64_t bit = NUM_BLOCKS; bit < (uint64_t)sb.bitmap_blocks * BITS_PER_BITMAP_BLOCK; bit++) {
+    bitmap[bit / 8] |= 1 << (bit % 8);
+  }
+
+  // count the free blocks under each bitmap block
+  free_counts = malloc(sb.bitmap_blocks * sizeof(uint32_t));
+  if (free_counts == NULL) {
+    bfs_unmount();
+    return -1;
+  }
+  for (uint32_t i = 0; i < sb.bitmap_blocks; i++) {
+    uint32_t allocated = 0;
+    for (size_t w = 0; w < WORDS_PER_BITMAP_BLOCK; w++) {
+      allocated += __builtin_popcountll(bitmap_word(i * WORDS_PER_BITMAP_BLOCK + w));
+    }
+    free_counts[i] = BITS_PER_BITMAP_BLOCK - allocated;
+    total_free += free_counts[i];
+  }
+  next_fit = 0;
+
+  // the bitmap is the authority; the superblock's copy of the free count is
+  // only stale if the disk wasn't unmounted cleanly, and is fixed at the
+  // next flush.  Disks made before the inode count existed don't have one.
+  inode_count_known = !raw_is_legacy() && (sb.flags & SB_HAS_INODE_COUNT);
+  num_inodes = inode_count_known ? sb.num_inodes : 0;
+  dir_parents_known = !raw_is_legacy() && (sb.flags & SB_HAS_DIR_PARENTS);
+
+  // from here on, changes reach the disk only through commit() (a journal
+  // too small to take the bitmap with room to spare isn't used beyond
+  // replaying it, since some transactions wouldn't fit)
+  if (!raw_is_legacy() && sb.journal_blocks != 0 &&
+      journal_capacity() >= (uint64_t)sb.bitmap_blocks + 1 + JOURNAL_MIN_ROOM) {
+    held = calloc(sb.bitmap_blocks, BLOCK_SIZE);
+    if (held == NULL) {
+      bfs_unmount();
+      return -1;
+    }
+    num_pending = 0;
+    window_open = 0;
+    journaled = 1;
+    cache_set_commit_hook(commit);
   }
   return 0;
 }
 
 
-block_num_t allocate_block() {
-  // read the superblock
-  char superblock[BLOCK_SIZE];
+void bfs_set_flush_interval(unsigned changes) {
+  flush_interval = changes;
+}
+
+
+void bfs_set_commit_interval(unsigned ms) {
+  commit_interval = ms;
+}
+
+
+void bfs_begin_batch() {
+  in_batch = 1;
+}
+
+
+void bfs_end_batch() {
+  in_batch = 0;
+}
+
+
+/* flush_bitmap
+ *   writes every changed bitmap block back to the disk in one batch
+ * returns 0 on success or -1 on failure
+ */
+static int flush_bitmap() {
+  if (bitmap == NULL || bitmap_dirty == NULL) {
+    return 0;
+  }
+  uint32_t dirty = 0;
+  for (uint32_t i = 0; i < sb.bitmap_blocks; i++) {
+    dirty += bitmap_dirty[i];
+  }
+  if (dirty == 0) {
+    bitmap_changes = 0;
+    return 0;
+  }
+
+  block_num_t* block_nums = malloc(dirty * sizeof(block_num_t));
+  void** bufs = malloc(dirty * sizeof(void*));
+  if (block_nums == NULL || bufs == NULL) {
+    free(block_nums);
+    free(bufs);
+    return -1;
+  }
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < sb.bitmap_blocks; i++) {
+    if (bitmap_dirty[i]) {
+      block_nums[n] = sb.bitmap_start + i;
+      bufs[n++] = bitmap + (size_t)i * BLOCK_SIZE;
+    }
+  }
+  int ret = write_blocks(block_nums, bufs, n);
+  free(block_nums);
+  free(bufs);
+  if (ret < 0) {
+    return -1;
+  }
+  memset(bitmap_dirty, 0, sb.bitmap_blocks);
+  bitmap_changes = 0;
+  return 0;
+}
+
+
+/* updated_superblock
+ *   fills superblock with the contents block 0 should have, if its
+ *   counters or flags are out of date
+ * (precondition: superblock is BLOCK_SIZE bytes long)
+ * returns 1 if they are, 0 if block 0 is up to date, or -1 on failure
+ */
+static int updated_superblock(char* superblock) {
+  uint32_t flags = sb.flags | (inode_count_known ? SB_HAS_INODE_COUNT : 0) |
+                   (dir_parents_known ? SB_HAS_DIR_PARENTS : 0);
+  if (sb.free_blocks == total_free && sb.num_inodes == num_inodes && sb.flags == flags) {
+    return 0;
+  }
   if (read_block(0, superblock) < 0) {
+    return -1;
+  }
+  struct superblock new_sb = sb;
+  new_sb.free_blocks = total_free;
+  new_sb.num_inodes = num_inodes;
+  new_sb.flags = flags;
+  memcpy(superblock, &new_sb, sizeof(new_sb));
+  return 1;
+}
+
+
+/* flush_free_space
+ *   writes the changed bitmap blocks, then the superblock if its counters
+ *   are out of date (legacy disks have no superblock to update)
+ * returns 0 on success or -1 on failure
+ */
+static int flush_free_space() {
+  if (flush_bitmap() < 0) {
+    return -1;
+  }
+  if (raw_is_legacy() || bitmap == NULL) {
     return 0;
   }
+  char superblock[BLOCK_SIZE];
+  int changed = updated_superblock(superblock);
+  if (changed <= 0) {
+    return changed;
+  }
+  memcpy(&sb, superblock, sizeof(sb));
+  return write_block(0, superblock);
+}
 
-  // find the first byte that is all allocated
-  int byte;
-  for (byte = 0;
-       byte < BLOCK_SIZE && superblock[byte] == (char)-1;
-       byte++) {}
-  // if all bytes are all allocated, then there are no free blocks
-  if (byte == BLOCK_SIZE) {
-    return 0; // no free blocks
+
+
+// records a change to the bitmap block holding bit block_num, flushing the
+// bitmap if the configured interval has been reached
+static int mark_changed(block_num_t block_num) {
+  bitmap_dirty[block_num / BITS_PER_BITMAP_BLOCK] = 1;
+  bitmap_changes++;
+  if (!journaled && !in_batch && flush_interval != 0 && bitmap_changes >= flush_interval) {
+    return flush_free_space();
+  }
+  return 0;
+}
+
+
+// milliseconds on a clock that never goes back
+static uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+// clears the bit of an allocated block
+static int free_block(block_num_t block) {
+  bitmap[block / 8] &= ~(1 << (block % 8));
+  free_counts[block / BITS_PER_BITMAP_BLOCK]++;
+  total_free++;
+  return mark_changed(block);
+}
+
+
+/* commit
+ *   the commit hook of a disk with a journal: writes every dirty cached
+ *   block, every changed bitmap block and (if its counters are out of date)
+ *   the superblock home through the journal as one transaction, which frees
+ *   the held blocks (they are only let go of if it succeeds)
+ * returns 0 on success or -1 on failure
+ */
+static int commit() {
+  if (bitmap == NULL) {
+    return 0;
+  }
+  window_open = 0;
+  size_t max_count = cache_dirty_count() + sb.bitmap_blocks + 1;
+  block_num_t* block_nums = malloc(max_count * sizeof(block_num_t));
+  const void** bufs = malloc(max_count * sizeof(void*));
+  if (block_nums == NULL || bufs == NULL) {
+    free(block_nums);
+    free(bufs);
+    return -1;
   }
 
-  // find the bit index of the first 0 bit
-  unsigned char field = superblock[byte];
-  int bit;
-  for (bit = 0; field & 1 && bit < 8; field >>= 1, bit++) {}
-  if (bit == 8) {
-    // this should be impossible because we checked that the byte is not all 1's
+  // the held blocks are free on the disk once the changes that stopped
+  // using them are, which is with this transaction: its bitmap shows them
+  // free, but they can only be handed out again once it is durable
+  for (size_t i = 0; i < num_pending; i++) {
+    free_block(pending[i]);
+  }
+  size_t count = cache_collect_dirty(block_nums, bufs);
+  for (uint32_t i = 0; i < sb.bitmap_blocks; i++) {
+    if (bitmap_dirty[i]) {
+      block_nums[count] = sb.bitmap_start + i;
+      bufs[count++] = bitmap + (size_t)i * BLOCK_SIZE;
+    }
+  }
+  char superblock[BLOCK_SIZE];
+  int changed = updated_superblock(superblock);
+  if (changed == 1) {
+    block_nums[count] = 0;
+    bufs[count++] = superblock;
+  }
+
+  int ret = (changed < 0) ? -1 : journal_commit(block_nums, bufs, count);
+  for (size_t i = 0; i < num_pending; i++) {
+    block_num_t block = pending[i];
+    if (ret == 0) {
+      held[block / 8] &= ~(1 << (block % 8));
+    } else {
+      // still in use on the disk; hold them until the next commit
+      bitmap[block / 8] |= 1 << (block % 8);
+      free_counts[block / BITS_PER_BITMAP_BLOCK]--;
+      total_free--;
+    }
+  }
+  if (ret == 0) {
+    num_pending = 0;
+    cache_mark_clean();
+    memset(bitmap_dirty, 0, sb.bitmap_blocks);
+    bitmap_changes = 0;
+    if (changed == 1) {
+      memcpy(&sb, superblock, sizeof(sb));
+    }
+  }
+  free(block_nums);
+  free(bufs);
+  return ret;
+}
+
+
+// the most changed blocks a transaction can take besides the bitmap and the
+// superblock, which a commit may write all of
+static uint32_t max_room() {
+  return journal_capacity() - sb.bitmap_blocks - 1;
+}
+
+
+uint32_t bfs_room() {
+  if (!journaled) {
+    return UINT32_MAX;
+  }
+  size_t dirty = cache_dirty_count();
+  return dirty < max_room() ? max_room() - dirty : 0;
+}
+
+
+int bfs_reserve(uint32_t changes, uint32_t allocations) {
+  if (!journaled) {
     return 0;
   }
+  if (bfs_room() < changes || (allocations > total_free && num_pending > 0)) {
+    return commit();
+  }
+  return 0;
+}
 
-  // set the found bit of the byte to 1
-  superblock[byte] |= 1 << bit;
 
-  // write the updated superblock back to disk
-  if (write_block(0, superblock) < 0) {
+int bfs_commit_point() {
+  if (!journaled) {
     return 0;
   }
-  return byte * 8 + bit;
+  uint64_t now = now_ms();
+  if (!window_open) {
+    window_open = 1;
+    window_start = now;
+  }
+  // Commit well before the changes outgrow one transaction or the cache, or
+  // hold back the free space; nothing else commits before the operation
+  // that follows is done, unless it asks bfs_reserve() for more room.
+  // (a batch keeps the window open, but not past these)
+  if ((!in_batch && now - window_start >= commit_interval) ||
+      bfs_room() < max_room() / 2 ||
+      cache_dirty_count() >= cache_get_capacity() / 2 || num_pending >= total_free) {
+    return commit();
+  }
+  return 0;
+}
+
+
+block_num_t bfs_root_block() {
+  return sb.root_block;
+}
+
+
+uint32_t bfs_free_blocks() {
+  return total_free + num_pending;
+}
+
+
+int bfs_inode_count_known() {
+  return inode_count_known;
+}
+
+
+uint32_t bfs_inode_count() {
+  return num_inodes;
+}
+
+
+void bfs_set_inode_count(uint32_t count) {
+  num_inodes = count;
+  inode_count_known = 1;
+}
+
+
+int bfs_dir_parents_known() {
+  return dir_parents_known;
+}
+
+
+void bfs_set_dir_parents_known() {
+  dir_parents_known = 1;
+}
+
+
+/* find_free_run
+ *   looks for a run of at least min_len free blocks, starting at the next-fit
+ *   cursor and wrapping around once; the run is cut off at max_len blocks
+ * returns 0 and the run in *start and *len, or -1 if there is no such run
+ */
+static int find_free_run(uint32_t min_len, uint32_t max_len,
+                         block_num_t* start, uint32_t* len) {
+  size_t total_words = (size_t)sb.bitmap_blocks * WORDS_PER_BITMAP_BLOCK;
+  size_t cursor_word = next_fit / 64;
+
+  // first from the cursor to the end, then from the start up to the cursor
+  for (int pass = 0; pass < 2; pass++) {
+    size_t w = pass == 0 ? cursor_word : 0;
+    size_t end = pass == 0 ? total_words : cursor_word + 1;
+    uint64_t run_start = 0;
+    uint64_t run_len = 0;
+
+    while (w < end) {
+      // skip bitmap blocks with nothing free in them
+      if (w % WORDS_PER_BITMAP_BLOCK == 0 && free_counts[w / WORDS_PER_BITMAP_BLOCK] == 0) {
+        if (run_len >= min_len) {
+          break;
+        }
+        run_len = 0;
+        w += WORDS_PER_BITMAP_BLOCK;
+        continue;
+      }
+
+      uint64_t free_bits = ~bitmap_word(w);
+      if (pass == 0 && w == cursor_word) {
+        // the bits before the cursor wait for the second pass
+        free_bits &= ~(((uint64_t)1 << (next_fit % 64)) - 1);
+      }
+
+      // walk the runs of free bits in this word
+      int k = 0;
+      while (k < 64) {
+        uint64_t rest = free_bits >> k;
+        int used = rest ? __builtin_ctzll(rest) : 64 - k;
+        if (used > 0) {
+          // an allocated block ends the current run
+          if (run_len >= min_len) {
+            break;
+          }
+          run_len = 0;
+          k += used;
+          if (k >= 64) {
+            break;
+          }
+          rest = free_bits >> k;
+        }
+        int free = ~rest ? __builtin_ctzll(~rest) : 64 - k;
+        if (run_len == 0) {
+          run_start = w * 64 + k;
+        }
+        run_len += free;
+        k += free;
+        if (run_len >= max_len) {
+          break;
+        }
+      }
+      if (run_len >= max_len || (k < 64 && run_len >= min_len)) {
+        break;
+      }
+      w++;
+    }
+
+    if (run_len >= min_len) {
+      *start = run_start;
+      *len = run_len < max_len ? run_len : max_len;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+
+// marks the run [start, start + len) allocated and moves the cursor past it
+static int claim_run(block_num_t start, uint32_t len) {
+  int result = 0;
+  for (uint32_t i = 0; i < len; i++) {
+    block_num_t block = start + i;
+    bitmap[block / 8] |= 1 << (block % 8);
+    free_counts[block / BITS_PER_BITMAP_BLOCK]--;
+    total_free--;
+    if (mark_changed(block) < 0) {
+      result = -1;
+    }
+  }
+  next_fit = (uint64_t)start + len < NUM_BLOCKS ? start + len : 0;
+  return result;
+}
+
+
+block_num_t allocate_block() {
+  block_num_t block;
+  uint32_t len;
+  if (total_free == 0 || find_free_run(1, 1, &block, &len) < 0) {
+    return 0; // no free blocks
+  }
+  if (claim_run(block, 1) < 0) {
+    // (the bit is set either way; don't lose the block)
+    release_block(block);
+    return 0;
+  }
+  return block;
+}
+
+
+int allocate_extent(uint32_t min_len, uint32_t max_len,
+                    block_num_t* start, uint32_t* len) {
+  if (min_len == 0 || max_len < min_len) {
+    return -1;
+  }
+  if (min_len > total_free || find_free_run(min_len, max_len, start, len) < 0) {
+    return -1;
+  }
+  if (claim_run(*start, *len) < 0) {
+    release_extent(*start, *len);
+    return -1;
+  }
+  return 0;
+}
+
+
+int allocate_blocks(uint32_t count, block_num_t* block_nums) {
+  if (count > total_free) {
+    return -1;
+  }
+
+  // ask for everything in one run; whenever no run that long is left, halve
+  // the shortest run we will accept, so the pieces stay as few as possible
+  uint32_t got = 0;
+  uint32_t min_len = count;
+  while (got < count) {
+    uint32_t want = count - got;
+    if (min_len > want) {
+      min_len = want;
+    }
+
+    block_num_t start;
+    uint32_t len;
+    if (find_free_run(min_len, want, &start, &len) == 0) {
+      int claimed = claim_run(start, len);
+      for (uint32_t i = 0; i < len; i++) {
+        block_nums[got++] = start + i;
+      }
+      if (claimed < 0) {
+        // the run's bits are set either way; give back everything we took
+        release_blocks(block_nums, got);
+        return -1;
+      }
+    } else if (min_len > 1) {
+      min_len /= 2;
+    } else {
+      // not enough free blocks; give back what we took
+      release_blocks(block_nums, got);
+      return -1;
+    }
+  }
+  return 0;
 }
 
 
 int release_block(block_num_t block) {
-  // read the superblock
-  char superblock[BLOCK_SIZE];
-  if (read_block(0, superblock) < 0) {
+  if (block >= NUM_BLOCKS) {
     return -1;
   }
 
-  // change bit corresponding to block num to 0
+  // change bit corresponding to block num to 0 (releasing a free block is a
+  // no-op, and must not count it as free twice)
   char mask = 1 << (block % 8);
-  superblock[block / 8] &= ~mask;
+  if (!(bitmap[block / 8] & mask)) {
+    return 0;
+  }
+  if (!journaled) {
+    return free_block(block);
+  }
 
-  // write the updated superblock back to disk
-  if (write_block(0, superblock) < 0) {
-    return -1;
+  // hold it back until the next commit (once)
+  if (held[block / 8] & mask) {
+    return 0;
+  }
+  if (num_pending == pending_capacity) {
+    size_t new_capacity = pending_capacity ? 2 * pending_capacity : 64;
+    block_num_t* new_pending = realloc(pending, new_capacity * sizeof(block_num_t));
+    if (new_pending == NULL) {
+      return -1;
+    }
+    pending = new_pending;
+    pending_capacity = new_capacity;
   }
+  held[block / 8] |= mask;
+  pending[num_pending++] = block;
   return 0;
 }
 
 
+int release_blocks(const block_num_t* block_nums, uint32_t count) {
+  int result = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (release_block(block_nums[i]) < 0) {
+      result = -1;
+    }
+  }
+  return result;
+}
+
+
+int release_extent(block_num_t start, uint32_t len) {
+  int result = 0;
+  for (uint32_t i = 0; i < len; i++) {
+    if (release_block(start + i) < 0) {
+      result = -1;
+    }
+  }
+  return result;
+}
+
+
+int bfs_sync() {
+  // (a commit syncs what it writes, but file data may have gone straight
+  // to the disk)
+  if (journaled ? commit() < 0 : flush_free_space() < 0 || cache_sync() < 0) {
+    return -1;
+  }
+  return raw_sync();
+}
+
+
 int bfs_unmount() {
-  return raw_unmount();
+  // write back everything still dirty before the disk goes away
+  int ret = journaled ? commit() : flush_free_space();
+  if (cache_destroy() < 0) {
+    ret = -1;
+  }
+  journal_close();
+  journaled = 0;
+  in_batch = 0;
+  free(bitmap);
+  free(bitmap_dirty);
+  free(free_counts);
+  free(held);
+  free(pending);
+  bitmap = NULL;
+  bitmap_dirty = NULL;
+  free_counts = NULL;
+  held = NULL;
+  pending = NULL;
+  num_pending = 0;
+  pending_capacity = 0;
+  if (raw_unmount() < 0) {
+    return -1;
+  }
+  return ret;
 }
@@ -2,9 +2,153 @@
 #define _BASIC_FILE_SYSTEM_H_
 
 #include "raw_disk.h"
+#include "buffer_cache.h"
+#include "journal.h"
 
+// superblock flag: num_inodes is kept up to date (disks made before the
+// count existed don't set it)
+#define SB_HAS_INODE_COUNT 1
+// superblock flag: directories record their parent (version 2 disks made
+// before they did don't set it)
+#define SB_HAS_DIR_PARENTS 2
+
+// group commit window of disks with a journal unless
+// bfs_set_commit_interval() says otherwise, in milliseconds
+#define BFS_DEFAULT_COMMIT_INTERVAL 50
+
+// Block 0 of a formatted disk.  It is followed by the free-space bitmap
+// (one bit per block, 1 = allocated), then the journal (see journal.h) and
+// then the root directory.  Disks made before the journal existed have
+// journal_blocks == 0, and their root directory follows the bitmap.
+struct superblock {
+  struct disk_header disk; // geometry, see raw_disk.h
+  uint32_t bitmap_start;   // first block of the bitmap
+  uint32_t bitmap_blocks;  // number of blocks in the bitmap
+  uint32_t root_block;     // directory block of the root directory
+  uint32_t free_blocks;    // unallocated blocks, as of the last bitmap flush
+  uint32_t num_inodes;     // files and directories, the root included
+  uint32_t flags;          // SB_* flags
+  uint32_t journal_start;  // first block of the journal
+  uint32_t journal_blocks; // number of blocks in the journal (0 if there is none)
+};
+
+
+/* bfs_mkfs
+ *   creates a new, empty file system in the given file (overwriting whatever
+ *   the file held before); the file system must not be mounted
+ * filename - the name of the disk file on the _real_ file system
+ * block_size - bytes per block (see raw_format())
+ * num_blocks - number of blocks on the disk (see raw_format())
+ * returns 0 on success or -1 on failure (including an invalid geometry)
+ */
+int bfs_mkfs(const char* filename, uint32_t block_size, uint32_t num_blocks);
+
+/* bfs_mount
+ *   mounts the disk in the given file; a file that doesn't exist yet (or is
+ *   empty) is first given a new file system with the default geometry
+ * returns 0 on success or -1 on failure
+ */
 int bfs_mount(const char* filename);
 
+/* bfs_set_flush_interval
+ *   the free bitmap is kept in memory while the disk is mounted and is
+ *   normally only written back by bfs_sync() and bfs_unmount(); this also
+ *   writes it back after every given number of allocations and releases
+ * changes - number of changes between writes (0, the default, turns the
+ *   periodic writes off)
+ */
+void bfs_set_flush_interval(unsigned changes);
+
+/* bfs_set_commit_interval
+ *   on a disk with a journal, every change (to cached blocks, the bitmap
+ *   and the superblock) reaches the disk in transactions that are all or
+ *   nothing after a crash.  A transaction takes in every change since the
+ *   one before, and is committed by bfs_sync(), bfs_unmount(), and by
+ *   bfs_commit_point() once the window set here has passed since the first
+ *   commit point after the last commit.
+ * ms - the window in milliseconds (0 commits at every commit point); the
+ *   default is BFS_DEFAULT_COMMIT_INTERVAL
+ */
+void bfs_set_commit_interval(unsigned ms);
+
+/* bfs_commit_point
+ *   tells the journal that no operation of the layer above is halfway done,
+ *   so the changes so far can be committed as a transaction; that happens if
+ *   the commit window has passed, the changes would soon not fit in the
+ *   journal or the block cache, or the blocks released since the last
+ *   commit outnumber the free ones.  Nothing is committed anywhere else
+ *   (but bfs_reserve(), bfs_sync() and bfs_unmount()), so after it at least
+ *   half of the room a transaction has is left for the next operation.  A
+ *   no-op without a journal.
+ * returns 0 on success or -1 on failure
+ */
+int bfs_commit_point();
+
+/* bfs_room
+ *   returns how many more blocks can be changed before the transaction is
+ *   full (UINT32_MAX without a journal); a block changed twice only counts
+ *   once, and allocations and releases don't count at all.  An operation
+ *   that changes more blocks than this before the next commit point can't
+ *   be committed.
+ */
+uint32_t bfs_room();
+
+/* bfs_reserve
+ *   like bfs_commit_point(), for an operation (or a part of one that leaves
+ *   everything consistent) about to change up to changes blocks and
+ *   allocate up to allocations blocks: commits first if they wouldn't fit
+ *   in the transaction, or would need the blocks released since the last
+ *   commit.  Afterwards, bfs_room() may still be too small if changes is
+ *   more than a transaction can ever take.
+ * returns 0 on success or -1 on failure
+ */
+int bfs_reserve(uint32_t changes, uint32_t allocations);
+
+/* bfs_begin_batch
+ *   starts a batch of operations: until bfs_end_batch(), the commit window
+ *   doesn't run out and (without a journal) the bitmap isn't written every
+ *   flush interval changes, so the changes of the whole batch build up in
+ *   memory for the next bfs_sync() to write together.  A batch that would
+ *   outgrow the journal or the block cache is still committed in parts,
+ *   between its operations.
+ */
+void bfs_begin_batch();
+
+/* bfs_end_batch
+ *   ends the batch started by bfs_begin_batch() (without writing anything)
+ */
+void bfs_end_batch();
+
+/* bfs_root_block
+ *   returns the block number of the root directory of the mounted disk
+ */
+block_num_t bfs_root_block();
+
+/* bfs_free_blocks
+ *   returns the number of blocks allocate_block() could still hand out
+ *   (with a journal, blocks released since the last commit are counted, but
+ *   are only handed out again after the next commit; see bfs_reserve())
+ */
+uint32_t bfs_free_blocks();
+
+/* bfs_inode_count_known / bfs_inode_count / bfs_set_inode_count
+ *   the number of files and directories on the disk, which the layer above
+ *   keeps up to date with bfs_set_inode_count(); it is stored in the
+ *   superblock, so it is unknown on legacy disks and disks made before it
+ *   existed until it is first set after mounting
+ */
+int bfs_inode_count_known();
+uint32_t bfs_inode_count();
+void bfs_set_inode_count(uint32_t count);
+
+/* bfs_dir_parents_known / bfs_set_dir_parents_known
+ *   whether every directory on the disk records its parent, which the layer
+ *   above declares with bfs_set_dir_parents_known() once it has made it so;
+ *   the flag is stored in the superblock
+ */
+int bfs_dir_parents_known();
+void bfs_set_dir_parents_known();
+
 /* allocate_block
  *   allocates a new block - finds a block that not yet allocated, marks it as
  *   allocated, and returns its block number - blocks marked as allocated will
@@ -16,6 +160,27 @@ int bfs_mount(const char* filename);
  */
 block_num_t allocate_block();
 
+/* allocate_extent
+ *   allocates a run of contiguous blocks, at least min_len and at most
+ *   max_len long (the first run found that is long enough, cut off at max_len)
+ * start - set to the first block of the run
+ * len - set to the number of blocks in the run
+ * returns 0 on success or -1 if there is no free run of min_len blocks
+ */
+int allocate_extent(uint32_t min_len, uint32_t max_len,
+                    block_num_t* start, uint32_t* len);
+
+/* allocate_blocks
+ *   allocates count blocks, contiguous if possible, and otherwise in as few
+ *   runs as it can; the runs are stored one after the other, so block_nums
+ *   is in ascending order within each run
+ * block_nums - receives the block numbers
+ * (precondition: block_nums has room for count entries)
+ * returns 0 on success or -1 if there aren't count free blocks (in which
+ *   case nothing is allocated)
+ */
+int allocate_blocks(uint32_t count, block_num_t* block_nums);
+
 /* release_block
  *   releases the specified disk block, allowing it to be allocated again by
  *   allocate_block() sometime in the future
@@ -27,6 +192,26 @@ block_num_t allocate_block();
  */
 int release_block(block_num_t block);
 
+/* release_blocks
+ *   releases every block in block_nums (see release_block())
+ * returns 0 on success and -1 if any release failed
+ */
+int release_blocks(const block_num_t* block_nums, uint32_t count);
+
+/* release_extent
+ *   releases the len blocks starting at start (see release_block())
+ * returns 0 on success and -1 if any release failed
+ */
+int release_extent(block_num_t start, uint32_t len);
+
+/* bfs_sync
+ *   writes the changed parts of the free bitmap and every block still dirty
+ *   in the block cache back to the disk and makes the disk durable (see
+ *   raw_sync())
+ * returns 0 on success and -1 on failure
+ */
+int bfs_sync();
+
 int bfs_unmount();
 
 #endif // _BASIC_FILE_SYSTEM_H_
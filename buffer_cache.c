@@ -0,0 +1,609 @@
+#include "buffer_cache.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// one cached block; free slots have valid == 0
+struct cache_entry {
+  block_num_t block_num;
+  char valid;
+  char dirty;
+  char referenced;   // second-chance bit for the CLOCK sweep
+  unsigned pinned;   // pinned entries are never evicted
+  int hash_next;     // next slot in the same hash chain, or -1
+  char* data;
+};
+
+static size_t cache_capacity = CACHE_DEFAULT_CAPACITY;
+
+static struct cache_entry* entries = NULL;
+static char* cache_data = NULL;
+static size_t num_entries = 0;
+static size_t clock_hand = 0;
+
+// data of the slots added by grow(), one chunk per call
+struct data_chunk {
+  struct data_chunk* next;
+  char data[];
+};
+static struct data_chunk* grown_data = NULL;
+
+// where cache_borrow_block() puts a block when every slot is pinned
+static char* bounce = NULL;
+
+// hash table mapping block numbers to slots (chains of slot indexes)
+static int* hash_heads = NULL;
+static size_t hash_mask = 0;
+
+// number of dirty entries
+static size_t num_dirty = 0;
+
+// see cache_set_commit_hook()
+static int (*commit_hook)() = NULL;
+
+// Threads in a shared section (see cache_begin_shared()) take cache_lock
+// around every call.  The cached blocks they borrow stay pinned until the
+// section ends, and blocks they couldn't cache are lent out as private
+// copies, freed then.
+#define MAX_SHARED_PINS 32
+struct private_copy {
+  struct private_copy* next;
+  char data[];
+};
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int in_shared = 0;
+static __thread int shared_pins[MAX_SHARED_PINS];
+static __thread int num_shared_pins = 0;
+static __thread struct private_copy* private_copies = NULL;
+
+
+static void enter() {
+  if (in_shared) {
+    pthread_mutex_lock(&cache_lock);
+  }
+}
+
+
+static void leave() {
+  if (in_shared) {
+    pthread_mutex_unlock(&cache_lock);
+  }
+}
+
+
+static size_t hash_block(block_num_t block_num) {
+  return ((uint32_t)block_num * 2654435761u) & hash_mask;
+}
+
+
+// returns the slot holding block_num, or -1 if it isn't cached
+static int lookup(block_num_t block_num) {
+  for (int i = hash_heads[hash_block(block_num)]; i != -1; i = entries[i].hash_next) {
+    if (entries[i].block_num == block_num) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+
+static void hash_insert(int slot) {
+  size_t h = hash_block(entries[slot].block_num);
+  entries[slot].hash_next = hash_heads[h];
+  hash_heads[h] = slot;
+}
+
+
+static void hash_remove(int slot) {
+  int* link = &hash_heads[hash_block(entries[slot].block_num)];
+  while (*link != slot) {
+    link = &entries[*link].hash_next;
+  }
+  *link = entries[slot].hash_next;
+}
+
+
+/* grow
+ *   doubles the number of slots, for when every one holds a block that
+ *   can't go (the new slots' data goes in a chunk of its own, so blocks
+ *   that have been lent out don't move)
+ * returns the first new slot, or -1 if there is no memory for them
+ */
+static int grow() {
+  size_t added = num_entries;
+  struct cache_entry* grown = realloc(entries, (num_entries + added) * sizeof(struct cache_entry));
+  if (grown == NULL) {
+    return -1;
+  }
+  entries = grown;
+  struct data_chunk* chunk = malloc(sizeof(struct data_chunk) + added * BLOCK_SIZE);
+  if (chunk == NULL) {
+    return -1;
+  }
+  chunk->next = grown_data;
+  grown_data = chunk;
+  memset(&entries[num_entries], 0, added * sizeof(struct cache_entry));
+  for (size_t i = 0; i < added; i++) {
+    entries[num_entries + i].data = chunk->data + i * BLOCK_SIZE;
+  }
+  int first = num_entries;
+  num_entries += added;
+
+  // keep the hash table at least twice as big as the cache (if there is
+  // no memory for a bigger one, the chains just get longer)
+  size_t num_heads = hash_mask + 1;
+  if (num_heads < 2 * num_entries) {
+    while (num_heads < 2 * num_entries) {
+      num_heads <<= 1;
+    }
+    int* heads = malloc(num_heads * sizeof(int));
+    if (heads != NULL) {
+      free(hash_heads);
+      hash_heads = heads;
+      hash_mask = num_heads - 1;
+      for (size_t i = 0; i < num_heads; i++) {
+        hash_heads[i] = -1;
+      }
+      for (size_t i = 0; i < num_entries; i++) {
+        if (entries[i].valid) {
+          hash_insert(i);
+        }
+      }
+    }
+  }
+  return first;
+}
+
+
+/* evict
+ *   runs the CLOCK hand until it finds a slot that can be reused, writing the
+ *   old contents back first if they are dirty
+ * returns the free slot, or -1 if every slot is pinned or the write-back failed
+ */
+static int evict() {
+  // two full sweeps are enough to clear every referenced bit once
+  for (size_t step = 0; step < 2 * num_entries; step++) {
+    int slot = clock_hand;
+    clock_hand = (clock_hand + 1) % num_entries;
+    struct cache_entry* e = &entries[slot];
+
+    if (!e->valid) {
+      return slot;
+    }
+    // with a commit hook, only a commit may write dirty blocks back, and
+    // a shared section writes nothing
+    if (e->pinned || (e->dirty && (commit_hook != NULL || in_shared))) {
+      continue;
+    }
+    if (e->referenced) {
+      e->referenced = 0;
+      continue;
+    }
+
+    if (e->dirty) {
+      if (write_block(e->block_num, e->data) < 0) {
+        return -1;
+      }
+      e->dirty = 0;
+      num_dirty--;
+    }
+    hash_remove(slot);
+    e->valid = 0;
+    return slot;
+  }
+
+  // Every block that could go is dirty.  The commit hook only commits
+  // between operations of the layer above, so hold on to them all until
+  // then (not from a shared section, which mustn't change anything).
+  if (commit_hook == NULL || in_shared) {
+    return -1;
+  }
+  return grow();
+}
+
+
+/* load
+ *   finds block_num in the cache, reading it from the disk if needed
+ * read_from_disk - if 0 the caller is about to overwrite the whole block, so
+ *   a miss doesn't need to read it
+ * returns the slot, or -1 if the block couldn't be cached
+ */
+static int load(block_num_t block_num, int read_from_disk) {
+  int slot = lookup(block_num);
+  if (slot != -1) {
+    entries[slot].referenced = 1;
+    return slot;
+  }
+
+  slot = evict();
+  if (slot == -1) {
+    return -1;
+  }
+  struct cache_entry* e = &entries[slot];
+  if (read_from_disk && read_block(block_num, e->data) < 0) {
+    return -1;
+  }
+  e->block_num = block_num;
+  e->valid = 1;
+  e->dirty = 0;
+  e->referenced = 1;
+  e->pinned = 0;
+  hash_insert(slot);
+  return slot;
+}
+
+
+void cache_set_capacity(size_t capacity) {
+  cache_capacity = capacity ? capacity : CACHE_DEFAULT_CAPACITY;
+}
+
+
+size_t cache_get_capacity() {
+  return cache_capacity;
+}
+
+
+int cache_init() {
+  num_entries = cache_capacity;
+  entries = calloc(num_entries, sizeof(struct cache_entry));
+  cache_data = malloc(num_entries * BLOCK_SIZE);
+  bounce = malloc(BLOCK_SIZE);
+
+  // keep the hash table at least twice as big as the cache
+  size_t num_heads = 1;
+  while (num_heads < 2 * num_entries) {
+    num_heads <<= 1;
+  }
+  hash_heads = malloc(num_heads * sizeof(int));
+  hash_mask = num_heads - 1;
+
+  if (entries == NULL || cache_data == NULL || bounce == NULL || hash_heads == NULL) {
+    free(entries);
+    free(cache_data);
+    free(bounce);
+    free(hash_heads);
+    entries = NULL;
+    cache_data = NULL;
+    bounce = NULL;
+    hash_heads = NULL;
+    return -1;
+  }
+
+  for (size_t i = 0; i < num_heads; i++) {
+    hash_heads[i] = -1;
+  }
+  for (size_t i = 0; i < num_entries; i++) {
+    entries[i].data = cache_data + i * BLOCK_SIZE;
+  }
+  clock_hand = 0;
+  num_dirty = 0;
+  return 0;
+}
+
+
+/* fill
+ *   caches a copy of a block a shared section has read from the disk (a
+ *   miss isn't read under cache_lock, so the threads' reads can overlap)
+ */
+static void fill(block_num_t block_num, const void* buf) {
+  enter();
+  int slot = load(block_num, 0);
+  if (slot != -1) {
+    memcpy(entries[slot].data, buf, BLOCK_SIZE);
+  }
+  leave();
+}
+
+
+int cache_read_block(block_num_t block_num, void* buf) {
+  if (in_shared) {
+    enter();
+    int slot = lookup(block_num);
+    if (slot != -1) {
+      entries[slot].referenced = 1;
+      memcpy(buf, entries[slot].data, BLOCK_SIZE);
+    }
+    leave();
+    if (slot != -1) {
+      return 0;
+    }
+    if (read_block(block_num, buf) < 0) {
+      return -1;
+    }
+    fill(block_num, buf);
+    return 0;
+  }
+
+  int slot = load(block_num, 1);
+  if (slot == -1) {
+    // everything is pinned; fall through to the disk
+    return read_block(block_num, buf);
+  }
+  memcpy(buf, entries[slot].data, BLOCK_SIZE);
+  return 0;
+}
+
+
+int cache_write_block(block_num_t block_num, const void* buf) {
+  int slot = load(block_num, 0);
+  if (slot == -1) {
+    // (a commit hook has to see every write, so then this is an error)
+    return commit_hook == NULL ? write_block(block_num, (void*)buf) : -1;
+  }
+  memcpy(entries[slot].data, buf, BLOCK_SIZE);
+  if (!entries[slot].dirty) {
+    entries[slot].dirty = 1;
+    num_dirty++;
+  }
+  return 0;
+}
+
+
+const void* cache_peek_block(block_num_t block_num) {
+  enter();
+  int slot = lookup(block_num);
+  if (slot != -1 && in_shared) {
+    // keep it from being evicted while the section looks at it
+    if (num_shared_pins < MAX_SHARED_PINS) {
+      entries[slot].pinned++;
+      shared_pins[num_shared_pins++] = slot;
+    } else {
+      slot = -1;
+    }
+  }
+  if (slot != -1) {
+    entries[slot].referenced = 1;
+  }
+  leave();
+  if (slot != -1) {
+    return entries[slot].data;
+  }
+  // not cached, but a mapped disk can still hand it out without I/O
+  return raw_block_ptr(block_num);
+}
+
+
+const void* cache_borrow_block(block_num_t block_num) {
+  const void* ptr = cache_peek_block(block_num);
+  if (ptr != NULL) {
+    return ptr;
+  }
+  if (in_shared) {
+    struct private_copy* copy = malloc(sizeof(struct private_copy) + BLOCK_SIZE);
+    if (copy == NULL) {
+      return NULL;
+    }
+    copy->next = private_copies;
+    private_copies = copy;
+    return cache_read_block(block_num, copy->data) < 0 ? NULL : copy->data;
+  }
+  int slot = load(block_num, 1);
+  if (slot == -1) {
+    // everything is pinned; lend out a private copy instead
+    if (read_block(block_num, bounce) < 0) {
+      return NULL;
+    }
+    return bounce;
+  }
+  return entries[slot].data;
+}
+
+
+/* is_bulk
+ *   batches bigger than a quarter of the cache bypass it, so one large file
+ *   transfer can't flush all the hot metadata out
+ */
+static int is_bulk(int count) {
+  return (size_t)count > cache_bulk_limit();
+}
+
+
+size_t cache_bulk_limit() {
+  return num_entries / 4;
+}
+
+
+int cache_read_blocks(const block_num_t* block_nums, void* const* bufs, int count) {
+  block_num_t* miss_nums = malloc(count * sizeof(block_num_t));
+  void** miss_bufs = malloc(count * sizeof(void*));
+  if (miss_nums == NULL || miss_bufs == NULL) {
+    free(miss_nums);
+    free(miss_bufs);
+    return -1;
+  }
+  int misses = 0;
+
+  // serve what we can from the cache and collect the rest
+  enter();
+  for (int i = 0; i < count; i++) {
+    int slot = lookup(block_nums[i]);
+    if (slot != -1) {
+      entries[slot].referenced = 1;
+      memcpy(bufs[i], entries[slot].data, BLOCK_SIZE);
+    } else {
+      miss_nums[misses] = block_nums[i];
+      miss_bufs[misses] = bufs[i];
+      misses++;
+    }
+  }
+  leave();
+
+  // keep all the misses in flight at once
+  int result = 0;
+  for (int i = 0; i < misses && result == 0; i++) {
+    result = submit_read_block(miss_nums[i], miss_bufs[i]);
+  }
+  if (wait_all() < 0) {
+    result = -1;
+  }
+
+  if (result == 0 && !is_bulk(misses)) {
+    enter();
+    for (int i = 0; i < misses; i++) {
+      int slot = load(miss_nums[i], 0);
+      if (slot != -1) {
+        memcpy(entries[slot].data, miss_bufs[i], BLOCK_SIZE);
+      }
+    }
+    leave();
+  }
+  free(miss_nums);
+  free(miss_bufs);
+  return result;
+}
+
+
+int cache_write_blocks(const block_num_t* block_nums, const void* const* bufs, int count) {
+  if (!is_bulk(count)) {
+    for (int i = 0; i < count; i++) {
+      if (cache_write_block(block_nums[i], bufs[i]) < 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  // write large batches straight through, all in flight at once, and keep
+  // any copies we already hold up to date (and clean)
+  int result = 0;
+  for (int i = 0; i < count && result == 0; i++) {
+    result = submit_write_block(block_nums[i], (void*)bufs[i]);
+  }
+  if (wait_all() < 0 || result < 0) {
+    return -1;
+  }
+  for (int i = 0; i < count; i++) {
+    int slot = lookup(block_nums[i]);
+    if (slot != -1) {
+      memcpy(entries[slot].data, bufs[i], BLOCK_SIZE);
+      if (entries[slot].dirty) {
+        entries[slot].dirty = 0;
+        num_dirty--;
+      }
+    }
+  }
+  return 0;
+}
+
+
+int cache_pin(block_num_t block_num) {
+  enter();
+  int slot = load(block_num, 1);
+  if (slot != -1) {
+    entries[slot].pinned++;
+  }
+  leave();
+  return slot == -1 ? -1 : 0;
+}
+
+
+void cache_unpin(block_num_t block_num) {
+  enter();
+  int slot = lookup(block_num);
+  if (slot != -1 && entries[slot].pinned > 0) {
+    entries[slot].pinned--;
+  }
+  leave();
+}
+
+
+void cache_begin_shared() {
+  in_shared = 1;
+}
+
+
+void cache_end_shared() {
+  pthread_mutex_lock(&cache_lock);
+  for (int i = 0; i < num_shared_pins; i++) {
+    entries[shared_pins[i]].pinned--;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  num_shared_pins = 0;
+  while (private_copies != NULL) {
+    struct private_copy* next = private_copies->next;
+    free(private_copies);
+    private_copies = next;
+  }
+  in_shared = 0;
+}
+
+
+void cache_set_commit_hook(int (*hook)()) {
+  commit_hook = hook;
+}
+
+
+size_t cache_dirty_count() {
+  return num_dirty;
+}
+
+
+size_t cache_collect_dirty(block_num_t* block_nums, const void** bufs) {
+  size_t count = 0;
+  for (size_t i = 0; i < num_entries; i++) {
+    if (entries[i].valid && entries[i].dirty) {
+      block_nums[count] = entries[i].block_num;
+      bufs[count++] = entries[i].data;
+    }
+  }
+  return count;
+}
+
+
+void cache_mark_clean() {
+  for (size_t i = 0; i < num_entries; i++) {
+    entries[i].dirty = 0;
+  }
+  num_dirty = 0;
+}
+
+
+int cache_sync() {
+  if (commit_hook != NULL) {
+    return num_dirty == 0 ? 0 : commit_hook();
+  }
+
+  // hand every dirty block to the disk at once; the I/O engine sorts them and
+  // merges adjacent ones into a single request
+  int result = 0;
+  for (size_t i = 0; i < num_entries && result == 0; i++) {
+    struct cache_entry* e = &entries[i];
+    if (e->valid && e->dirty) {
+      result = submit_write_block(e->block_num, e->data);
+    }
+  }
+  if (wait_all() < 0) {
+    result = -1;
+  }
+  if (result < 0) {
+    return -1;
+  }
+
+  cache_mark_clean();
+  return 0;
+}
+
+
+int cache_destroy() {
+  if (entries == NULL) {
+    return 0;
+  }
+  int result = cache_sync();
+  commit_hook = NULL;
+  while (grown_data != NULL) {
+    struct data_chunk* next = grown_data->next;
+    free(grown_data);
+    grown_data = next;
+  }
+  free(entries);
+  free(cache_data);
+  free(bounce);
+  free(hash_heads);
+  entries = NULL;
+  cache_data = NULL;
+  bounce = NULL;
+  hash_heads = NULL;
+  num_entries = 0;
+  return result;
+}
@@ -0,0 +1,172 @@
+#ifndef _BUFFER_CACHE_H_
+#define _BUFFER_CACHE_H_
+
+#include "raw_disk.h"
+#include <stddef.h>
+
+// number of blocks the cache holds unless cache_set_capacity() says otherwise
+#define CACHE_DEFAULT_CAPACITY 64
+
+/* cache_set_capacity
+ *   sets the number of blocks the cache will hold; takes effect the next time
+ *   cache_init() is called (i.e. at the next mount)
+ * capacity - number of blocks (0 selects CACHE_DEFAULT_CAPACITY)
+ */
+void cache_set_capacity(size_t capacity);
+
+/* cache_get_capacity
+ *   returns the number of blocks the cache holds (or will hold once
+ *   initialized)
+ */
+size_t cache_get_capacity();
+
+/* cache_init
+ *   allocates an empty cache in front of the raw disk; must be called after
+ *   raw_mount() and before any other cache_* function
+ * returns 0 on success or -1 on failure
+ */
+int cache_init();
+
+/* cache_read_block
+ *   reads a block through the cache, loading it from the disk on a miss
+ * block_num - number of the block to read
+ * buf - data will be copied into this buffer
+ * (precondition: buf is BLOCK_SIZE bytes long)
+ * returns 0 on success or -1 on failure
+ */
+int cache_read_block(block_num_t block_num, void* buf);
+
+/* cache_write_block
+ *   writes a block into the cache and marks it dirty; the disk is only
+ *   updated when the block is evicted or the cache is synced
+ * block_num - number of the block to write
+ * buf - buffer containing the data to write
+ * (precondition: buf is BLOCK_SIZE bytes long)
+ * returns 0 on success or -1 on failure
+ */
+int cache_write_block(block_num_t block_num, const void* buf);
+
+/* cache_peek_block
+ *   borrows a read-only pointer to a block's current contents, if that is
+ *   possible without any disk I/O (the block is cached, or the disk is mapped)
+ * block_num - number of the block
+ * returns a pointer to BLOCK_SIZE bytes, valid until the next cache_* call
+ *   (in a shared section, until the section ends), or NULL if the block
+ *   would have to be read first
+ */
+const void* cache_peek_block(block_num_t block_num);
+
+/* cache_borrow_block
+ *   like cache_peek_block(), but loads the block into the cache if needed
+ * returns a pointer to BLOCK_SIZE bytes, valid until the next cache_* call
+ *   (in a shared section, until the section ends), or NULL on failure
+ */
+const void* cache_borrow_block(block_num_t block_num);
+
+/* cache_read_blocks
+ *   reads several blocks through the cache; all the misses are submitted to
+ *   the disk together and waited for once
+ * block_nums - numbers of the blocks to read
+ * bufs - bufs[i] receives block block_nums[i]
+ * (precondition: every buffer is BLOCK_SIZE bytes long)
+ * count - number of entries in block_nums and bufs
+ * returns 0 on success or -1 on failure
+ */
+int cache_read_blocks(const block_num_t* block_nums, void* const* bufs, int count);
+
+/* cache_write_blocks
+ *   writes several blocks through the cache; small batches are buffered like
+ *   cache_write_block(), large ones go straight to the disk with every write
+ *   in flight at once
+ * block_nums - numbers of the blocks to write
+ * bufs - bufs[i] holds the data for block block_nums[i]
+ * (precondition: every buffer is BLOCK_SIZE bytes long)
+ * count - number of entries in block_nums and bufs
+ * returns 0 on success or -1 on failure
+ */
+int cache_write_blocks(const block_num_t* block_nums, const void* const* bufs, int count);
+
+/* cache_bulk_limit
+ *   returns the most blocks cache_read_blocks() and cache_write_blocks()
+ *   take through the cache; bigger batches go straight to the disk (so
+ *   their writes are never held back for the commit hook)
+ */
+size_t cache_bulk_limit();
+
+/* cache_pin
+ *   loads a block (if it isn't cached already) and keeps it resident until
+ *   a matching cache_unpin(); pins nest
+ * returns 0 on success or -1 on failure
+ */
+int cache_pin(block_num_t block_num);
+
+/* cache_unpin
+ *   drops one pin taken by cache_pin(); unpinning a block that is not pinned
+ *   is a no-op
+ */
+void cache_unpin(block_num_t block_num);
+
+/* cache_begin_shared
+ *   starts a shared section in the calling thread: until cache_end_shared(),
+ *   other threads may be in shared sections at the same time, so the
+ *   thread may only read (cache_read_block(), cache_read_blocks(),
+ *   cache_peek_block(), cache_borrow_block(), cache_pin() and
+ *   cache_unpin()), and no thread may be outside a shared section meanwhile.
+ *   Dirty blocks are never written back from a shared section.
+ */
+void cache_begin_shared();
+
+/* cache_end_shared
+ *   ends the calling thread's shared section; the blocks it borrowed are
+ *   no longer valid
+ */
+void cache_end_shared();
+
+/* cache_set_commit_hook
+ *   hands writing dirty blocks back over to the caller (a journal): from
+ *   now on the cache never writes a dirty block to the disk by itself, but
+ *   calls hook (which must write back every dirty block, see
+ *   cache_collect_dirty(), and then call cache_mark_clean()) from
+ *   cache_sync().  When every block in the cache is dirty or pinned, the
+ *   cache grows past its capacity instead (until cache_destroy(), which
+ *   also drops the hook).
+ * hook - returns 0 on success or -1 on failure
+ */
+void cache_set_commit_hook(int (*hook)());
+
+/* cache_dirty_count
+ *   returns the number of dirty blocks in the cache
+ */
+size_t cache_dirty_count();
+
+/* cache_collect_dirty
+ *   lists the dirty blocks, for a commit hook
+ * block_nums - receives the numbers of the dirty blocks
+ * bufs - bufs[i] receives a pointer to the cached contents of block
+ *   block_nums[i], valid until the next cache_* call other than
+ *   cache_mark_clean()
+ * (precondition: both have room for cache_dirty_count() entries)
+ * returns the number of dirty blocks
+ */
+size_t cache_collect_dirty(block_num_t* block_nums, const void** bufs);
+
+/* cache_mark_clean
+ *   marks every block clean, once a commit hook has written them back
+ */
+void cache_mark_clean();
+
+/* cache_sync
+ *   writes every dirty block back to the disk, all submitted at once so
+ *   adjacent blocks share a request (or through the commit hook, if there
+ *   is one); the blocks stay cached
+ * returns 0 on success or -1 on failure
+ */
+int cache_sync();
+
+/* cache_destroy
+ *   syncs the cache and frees it; must be called before raw_unmount()
+ * returns 0 on success or -1 if the final sync failed
+ */
+int cache_destroy();
+
+#endif // _BUFFER_CACHE_H_
@@ -2,6 +2,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include "jumbo_file_system.h"
 
 #define DISK_FILENAME "DISK"
@@ -9,6 +10,34 @@
 #define MAX_ARGS 2
 #define WHITESPACE_DELIM " \t\r\n"
 
+// bytes cat and head read from the file system at a time
+#define READ_CHUNK_SIZE 65536
+
+
+// names collected by ls
+struct name_list {
+  char (*names)[MAX_NAME_LENGTH + 1];
+  size_t count;
+  size_t capacity;
+};
+
+
+// jfs_ls_each() callback for ls: lists[0] gets directories, lists[1] files
+int collect_name(const char* name, int is_dir, void* arg) {
+  struct name_list* list = &((struct name_list*)arg)[is_dir ? 0 : 1];
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity ? 2 * list->capacity : 64;
+    void* names = realloc(list->names, capacity * sizeof(*list->names));
+    if (NULL == names) {
+      return E_UNKNOWN;
+    }
+    list->names = names;
+    list->capacity = capacity;
+  }
+  strcpy(list->names[list->count++], name);
+  return 0;
+}
+
 
 void print_error(int err, const char* name) {
     switch (err) {
@@ -41,6 +70,9 @@ void print_error(int err, const char* name) {
     case E_DISK_FULL:
       printf("disk is full");
       break;
+    case E_BAD_PATH:
+      printf("%s can't be used here\n", name);
+      break;
     case E_UNKNOWN:
       printf("an unknown error occurred\n");
       break;
@@ -50,6 +82,40 @@ void print_error(int err, const char* name) {
 }
 
 
+/* print_file
+ *   writes up to limit bytes of a file to stdout, reading it a chunk at a
+ *   time so files of any size can be shown
+ */
+void print_file(const char* file_name, size_t limit) {
+  char* file_data = malloc(READ_CHUNK_SIZE);
+  if (NULL == file_data) {
+    perror("Failed to allocate a read buffer");
+    return;
+  }
+  uint64_t offset = 0;
+  int ret = E_SUCCESS;
+  while (offset < limit) {
+    size_t bytes_read = (limit - offset < READ_CHUNK_SIZE) ? limit - offset : READ_CHUNK_SIZE;
+    ret = jfs_pread(file_name, file_data, &bytes_read, offset);
+    if (E_SUCCESS != ret || 0 == bytes_read) {
+      break;
+    }
+    if (write(STDOUT_FILENO, file_data, bytes_read) != (ssize_t)bytes_read) {
+      perror("Failed to write file data to stdout");
+      break;
+    }
+    offset += bytes_read;
+  }
+
+  if (E_SUCCESS == ret) {
+    printf("\n");
+  } else {
+    print_error(ret, file_name);
+  }
+  free(file_data);
+}
+
+
 /* run_command
  *   Runs one entire command line, which may include multiple pipeline stages
  */
@@ -103,24 +169,23 @@ void run_command(char* command_line) {
       return;
     }
 
-    char* directories[MAX_DIR_ENTRIES+1];
-    char* files[MAX_DIR_ENTRIES+1];
-    memset(directories, -1, MAX_DIR_ENTRIES * sizeof(const char*));
-    memset(files,       -1, MAX_DIR_ENTRIES * sizeof(const char*));
-    int ret = jfs_ls(directories, files);
+    // a directory can hold far too many names for arrays on the stack, so
+    // collect them as they stream by
+    struct name_list lists[2] = {{NULL, 0, 0}, {NULL, 0, 0}}; // directories, files
+    int ret = jfs_ls_each(collect_name, lists);
 
     if (E_SUCCESS == ret) {
-      for (int i = 0; NULL != directories[i]; i++) {
-        printf("%s/\n", directories[i]);
-        free(directories[i]);
+      for (size_t i = 0; i < lists[0].count; i++) {
+        printf("%s/\n", lists[0].names[i]);
       }
-      for (int i = 0; NULL != files[i]; i++) {
-        printf("%s\n", files[i]);
-        free(files[i]);
+      for (size_t i = 0; i < lists[1].count; i++) {
+        printf("%s\n", lists[1].names[i]);
       }
     } else {
       printf("ls failed - but ls should never fail!\n");
     }
+    free(lists[0].names);
+    free(lists[1].names);
 
   } else if (0 == strcmp(tokens[0], "touch")) {
     if (NULL == tokens[1] || NULL != tokens[2]) {
@@ -169,24 +234,7 @@ void run_command(char* command_line) {
       return;
     }
 
-    unsigned short bytes_read = MAX_FILE_SIZE;
-    char* file_name = strdup(tokens[1]);
-    char* file_data = malloc(MAX_FILE_SIZE * sizeof(char));
-    memset(file_data, -1, MAX_FILE_SIZE);
-
-    int ret = jfs_read(file_name, file_data, &bytes_read);
-    if (E_SUCCESS == ret) {
-      ret = write(STDOUT_FILENO, file_data, bytes_read);
-      printf("\n");
-      if (ret != bytes_read) {
-        perror("Failed to write file data to stdout");
-      }
-    } else {
-      print_error(ret, file_name);
-    }
-
-    free(file_data);
-    free(file_name);
+    print_file(tokens[1], SIZE_MAX);
 
   } else if (0 == strcmp(tokens[0], "head")) {
     if (NULL == tokens[1] || NULL == tokens[2]) {
@@ -195,31 +243,12 @@ void run_command(char* command_line) {
     }
 
     char* endptr = NULL;
-    unsigned long bytes_read = strtoul(tokens[2], &endptr, 10);
+    unsigned long num_bytes = strtoul(tokens[2], &endptr, 10);
     if (*endptr != '\0') {
       fprintf(stderr, "usage: head <file_name> <num_bytes>\n<num_bytes> must be an integer.\n");
       return;
     }
-    if (bytes_read > MAX_FILE_SIZE)
-      bytes_read = MAX_FILE_SIZE;
-
-    char* file_name = strdup(tokens[1]);
-    char* file_data = malloc(bytes_read * sizeof(char));
-    memset(file_data, -1, bytes_read);
-
-    int ret = jfs_read(file_name, file_data, &bytes_read);
-    if (E_SUCCESS == ret) {
-      ret = write(STDOUT_FILENO, file_data, bytes_read);
-      printf("\n");
-      if (ret != bytes_read) {
-        perror("Failed to write file data to stdout");
-      }
-    } else {
-      print_error(ret, file_name);
-    }
-
-    free(file_data);
-    free(file_name);
+    print_file(tokens[1], num_bytes);
 
   } else if (0 == strcmp(tokens[0], "append")) {
     if (NULL == tokens[1] || NULL == tokens[2]) {
@@ -235,6 +264,45 @@ void run_command(char* command_line) {
     free(file_data);
     free(file_name);
 
+  } else if (0 == strcmp(tokens[0], "df")) {
+    if (NULL != tokens[1]) {
+      fprintf(stderr, "usage: df\n");
+      return;
+    }
+
+    struct fs_stats disk_stats;
+    jfs_statfs(&disk_stats);
+    printf("Block size: %u\n", disk_stats.block_size);
+    printf("Total blocks: %u\n", disk_stats.total_blocks);
+    printf("Used blocks: %u\n", disk_stats.used_blocks);
+    printf("Free blocks: %u\n", disk_stats.free_blocks);
+    printf("Files and directories: %u\n", disk_stats.num_inodes);
+
+  } else if (0 == strcmp(tokens[0], "sync")) {
+    if (NULL != tokens[1]) {
+      fprintf(stderr, "usage: sync\n");
+      return;
+    }
+    if (jfs_sync() < 0) {
+      print_error(E_UNKNOWN, NULL);
+    }
+
+  } else if (0 == strcmp(tokens[0], "begin")) {
+    if (NULL != tokens[1]) {
+      fprintf(stderr, "usage: begin\n");
+      return;
+    }
+    jfs_batch_begin();
+
+  } else if (0 == strcmp(tokens[0], "commit")) {
+    if (NULL != tokens[1]) {
+      fprintf(stderr, "usage: commit\n");
+      return;
+    }
+    if (jfs_batch_commit() < 0) {
+      print_error(E_UNKNOWN, NULL);
+    }
+
   } else {
     fprintf(stderr, "ERROR: unrecognized command\n");
   }
@@ -242,17 +310,24 @@ void run_command(char* command_line) {
 
 
 /* prompt_for_input
- *   Prompts the user for a command, and takes a line of input
+ *   Prompts the user for a command, and takes a line of input.  The end of
+ *   the input (or a failure to read it) counts as "exit", so the file system
+ *   is still unmounted and what it holds in memory reaches the disk.
  */
 void prompt_for_input(char* input_buffer, int buflen) {
   int done = 0; // FALSE
   while (!done) {
     printf("jfs$ ");  /* prompt */
     if (NULL == fgets(input_buffer, buflen, stdin)) {
-      perror("FATAL ERROR: fgets failed");
-      exit(1);
-      /* alternatively, we could have looped to try input again
-       * but that runs the risk of an infinite loop if input is totally broken */
+      if (ferror(stdin)) {
+        perror("ERROR: fgets failed");
+      } else {
+        printf("\n");
+      }
+      /* we could loop to try input again, but that runs the risk of an
+       * infinite loop if input is totally broken */
+      strcpy(input_buffer, "exit\n");
+      return;
     }
 
     /* Note that if buflen isn't long enough, that isn't an error.
@@ -261,9 +336,15 @@ void prompt_for_input(char* input_buffer, int buflen) {
      * Our solution will be to detect the situation, report an error,
      * empty out the stdin buffer, and then re-prompt for a new input.
      */
-    if (input_buffer[strlen(input_buffer)-1] != '\n') {
+    size_t len = strlen(input_buffer);
+    if (input_buffer[len-1] != '\n' && feof(stdin) && len + 1 < (size_t)buflen) {
+      /* a last line without a newline is complete */
+      strcpy(&input_buffer[len], "\n");
+      done = 1; // TRUE
+    } else if (input_buffer[len-1] != '\n') {
       fprintf(stderr, "ERROR: line exceeds maximum command line length\n");
-      while('\n' != getc(stdin)) {} /* consume rest of line from the buffer */
+      int c;
+      while ('\n' != (c = getc(stdin)) && EOF != c) {} /* consume rest of line from the buffer */
     } else {
       done = 1; // TRUE
     }
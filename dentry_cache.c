@@ -0,0 +1,83 @@
+#include "dentry_cache.h"
+#include <string.h>
+#include <pthread.h>
+
+// Direct-mapped: every (parent, name) pair has exactly one slot it can live
+// in, and a newer pair simply takes the slot over.  Lookups from several
+// threads at once share it under table_lock.
+static struct dentry table[DENTRY_CACHE_SIZE];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// returns the slot for (parent, name); name must fit in a dentry
+static struct dentry* slot_for(block_num_t parent, const char* name) {
+  // FNV-1a over the name, then mixed with the parent block
+  uint32_t h = 2166136261u;
+  for (const char* c = name; *c != '\0'; c++) {
+    h = (h ^ (unsigned char)*c) * 16777619u;
+  }
+  h ^= (uint32_t)parent * 2654435761u;
+  return &table[h & (DENTRY_CACHE_SIZE - 1)];
+}
+
+
+// checks that a name can be cached at all
+static int cacheable(const char* name) {
+  return strlen(name) <= MAX_NAME_LENGTH;
+}
+
+
+void dcache_clear() {
+  pthread_mutex_lock(&table_lock);
+  memset(table, 0, sizeof(table));
+  pthread_mutex_unlock(&table_lock);
+}
+
+
+int dcache_lookup(block_num_t parent, const char* name, struct dentry* entry) {
+  if (!cacheable(name)) {
+    return DCACHE_MISS;
+  }
+  pthread_mutex_lock(&table_lock);
+  struct dentry found = *slot_for(parent, name);
+  pthread_mutex_unlock(&table_lock);
+  if (!found.valid || found.parent != parent || strcmp(found.name, name) != 0) {
+    return DCACHE_MISS;
+  }
+  if (found.child == 0) {
+    return DCACHE_NEGATIVE;
+  }
+  *entry = found;
+  return DCACHE_HIT;
+}
+
+
+void dcache_insert(block_num_t parent, const char* name, block_num_t child, int is_dir) {
+  if (!cacheable(name)) {
+    return;
+  }
+  pthread_mutex_lock(&table_lock);
+  struct dentry* d = slot_for(parent, name);
+  d->parent = parent;
+  d->child = child;
+  d->is_dir = is_dir;
+  d->valid = 1;
+  strcpy(d->name, name);
+  pthread_mutex_unlock(&table_lock);
+}
+
+
+void dcache_insert_negative(block_num_t parent, const char* name) {
+  dcache_insert(parent, name, 0, 0);
+}
+
+
+void dcache_purge_dir(block_num_t parent) {
+  pthread_mutex_lock(&table_lock);
+  for (size_t i = 0; i < DENTRY_CACHE_SIZE; i++) {
+    if (table[i].parent == parent) {
+      table[i].valid = 0;
+    }
+  }
+  pthread_mutex_unlock(&table_lock);
+}
@@ -0,0 +1,58 @@
+#ifndef _DENTRY_CACHE_H_
+#define _DENTRY_CACHE_H_
+
+#include "jumbo_file_system.h"
+
+// number of entries in the cache (a power of two)
+#define DENTRY_CACHE_SIZE 1024
+
+// results of dcache_lookup()
+#define DCACHE_MISS -1    // nothing is known about the name
+#define DCACHE_NEGATIVE 0 // the name is known not to exist
+#define DCACHE_HIT 1      // the name exists
+
+// what the cache knows about one name in one directory
+struct dentry {
+  block_num_t parent; // dir block of the directory holding the name
+  block_num_t child;  // inode or dir block the name refers to (0 if negative)
+  char is_dir;        // 1 if child is a directory
+  char valid;
+  char name[MAX_NAME_LENGTH + 1];
+};
+
+/* dcache_clear
+ *   forgets everything (e.g. when a disk is mounted or unmounted)
+ */
+void dcache_clear();
+
+/* dcache_lookup
+ *   looks a name up in a directory
+ * parent - dir block of the directory
+ * name - the name to look for
+ * entry - receives what is known about the name on DCACHE_HIT
+ * returns DCACHE_HIT, DCACHE_NEGATIVE or DCACHE_MISS
+ */
+int dcache_lookup(block_num_t parent, const char* name, struct dentry* entry);
+
+/* dcache_insert
+ *   records that a name exists in a directory (replacing anything known
+ *   about it)
+ * parent - dir block of the directory
+ * name - the name
+ * child - inode or dir block the name refers to
+ * is_dir - 1 if child is a directory
+ */
+void dcache_insert(block_num_t parent, const char* name, block_num_t child, int is_dir);
+
+/* dcache_insert_negative
+ *   records that a name doesn't exist in a directory
+ */
+void dcache_insert_negative(block_num_t parent, const char* name);
+
+/* dcache_purge_dir
+ *   forgets every name in a directory (its block is about to be released,
+ *   and may come back as a different directory)
+ */
+void dcache_purge_dir(block_num_t parent);
+
+#endif // _DENTRY_CACHE_H_
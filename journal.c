@@ -0,0 +1,198 @@
+#include "journal.h"
+#include <stdlib.h>
+#include <string.h>
+
+// where the journal of the mounted disk is (num_blocks is 0 if there is none)
+static block_num_t journal_start = 0;
+static uint32_t journal_blocks = 0;
+static uint32_t capacity = 0;
+
+
+// returns the number of blocks a header listing count blocks takes up
+static uint64_t header_blocks(uint64_t count) {
+  uint64_t bytes = sizeof(struct journal_header) + (uint64_t)count * sizeof(block_num_t);
+  return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+
+// folds len bytes into an FNV-1a hash
+static uint64_t fnv1a(uint64_t h, const void* data, size_t len) {
+  const unsigned char* p = data;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 1099511628211u;
+  }
+  return h;
+}
+
+
+static uint64_t checksum(const block_num_t* block_nums, const void* const* bufs, uint32_t count) {
+  uint64_t h = fnv1a(14695981039346656037u, block_nums, count * sizeof(block_num_t));
+  for (uint32_t i = 0; i < count; i++) {
+    h = fnv1a(h, bufs[i], BLOCK_SIZE);
+  }
+  return h;
+}
+
+
+/* write_and_sync
+ *   writes the blocks (in one batch) and waits until they are durable
+ * returns 0 on success or -1 on failure
+ */
+static int write_and_sync(const block_num_t* block_nums, void* const* bufs, uint32_t count) {
+  if (write_blocks(block_nums, bufs, count) < 0) {
+    return -1;
+  }
+  return raw_sync();
+}
+
+
+// empties the journal
+static int clear() {
+  char block[BLOCK_SIZE];
+  memset(block, 0, BLOCK_SIZE);
+  void* buf = block;
+  return write_and_sync(&journal_start, &buf, 1);
+}
+
+
+/* commit_one
+ *   journal_commit() for a transaction of at least one block
+ * returns 0 on success or -1 on failure
+ */
+static int commit_one(const block_num_t* block_nums, const void* const* bufs, uint32_t count) {
+  uint32_t list = header_blocks(count);
+  char* header_data = calloc(list, BLOCK_SIZE);
+  block_num_t* journal_nums = malloc((list + count) * sizeof(block_num_t));
+  void** journal_bufs = malloc((list + count) * sizeof(void*));
+  int ret = -1;
+  if (header_data != NULL && journal_nums != NULL && journal_bufs != NULL) {
+    struct journal_header* header = (struct journal_header*)header_data;
+    header->magic = JOURNAL_MAGIC;
+    header->count = count;
+    header->checksum = checksum(block_nums, bufs, count);
+    memcpy(header->block_nums, block_nums, count * sizeof(block_num_t));
+    for (uint32_t i = 0; i < list + count; i++) {
+      journal_nums[i] = journal_start + i;
+      journal_bufs[i] = i < list ? header_data + (size_t)i * BLOCK_SIZE : (void*)bufs[i - list];
+    }
+
+    // each step is durable before the next one starts
+    ret = write_and_sync(journal_nums, journal_bufs, list + count);
+    if (ret == 0) {
+      ret = write_and_sync(block_nums, (void* const*)bufs, count);
+    }
+    if (ret == 0) {
+      ret = clear();
+    }
+  }
+  free(header_data);
+  free(journal_nums);
+  free(journal_bufs);
+  return ret;
+}
+
+
+/* replay
+ *   writes home the transaction the journal holds, if it was committed, and
+ *   clears the journal
+ * returns 0 on success or -1 on failure
+ */
+static int replay() {
+  char first[BLOCK_SIZE];
+  if (read_block(journal_start, first) < 0) {
+    return -1;
+  }
+  const struct journal_header* peek = (const struct journal_header*)first;
+  if (peek->magic != JOURNAL_MAGIC) {
+    return 0;
+  }
+  uint32_t count = peek->count;
+  if (count == 0 || count > capacity) {
+    // torn before it was committed
+    return clear();
+  }
+
+  // read the whole transaction back
+  uint32_t total = header_blocks(count) + count;
+  char* data = malloc((size_t)total * BLOCK_SIZE);
+  block_num_t* journal_nums = malloc(total * sizeof(block_num_t));
+  void** journal_bufs = malloc(total * sizeof(void*));
+  int ret = -1;
+  if (data != NULL && journal_nums != NULL && journal_bufs != NULL) {
+    for (uint32_t i = 0; i < total; i++) {
+      journal_nums[i] = journal_start + i;
+      journal_bufs[i] = data + (size_t)i * BLOCK_SIZE;
+    }
+    ret = read_blocks(journal_nums, journal_bufs, total);
+  }
+  if (ret == 0) {
+    const struct journal_header* header = (const struct journal_header*)data;
+    void* const* bufs = &journal_bufs[total - count];
+    int valid = checksum(header->block_nums, (const void* const*)bufs, count) == header->checksum;
+    for (uint32_t i = 0; i < count && valid; i++) {
+      block_num_t home = header->block_nums[i];
+      valid = home < NUM_BLOCKS && (home < journal_start || home >= journal_start + journal_blocks);
+    }
+    if (valid) {
+      ret = write_and_sync(header->block_nums, bufs, count);
+    }
+  }
+  if (ret == 0) {
+    ret = clear();
+  }
+  free(data);
+  free(journal_nums);
+  free(journal_bufs);
+  return ret;
+}
+
+
+int journal_open(block_num_t start, uint32_t num_blocks) {
+  if (num_blocks < 2) {
+    return -1;
+  }
+  journal_start = start;
+  journal_blocks = num_blocks;
+
+  // every block costs a journal block and an entry in the header
+  capacity = num_blocks - 1;
+  while (header_blocks(capacity) + capacity > num_blocks) {
+    capacity--;
+  }
+
+  if (replay() < 0) {
+    journal_close();
+    return -1;
+  }
+  return 0;
+}
+
+
+uint32_t journal_capacity() {
+  return capacity;
+}
+
+
+uint32_t journal_blocks_for(uint64_t count) {
+  uint64_t blocks = count + header_blocks(count);
+  return blocks < UINT32_MAX ? blocks : UINT32_MAX;
+}
+
+
+int journal_commit(const block_num_t* block_nums, const void* const* bufs, uint32_t count) {
+  if (count == 0) {
+    return 0;
+  }
+  // (split in two, a crash between the halves would leave half of it done)
+  if (count > capacity) {
+    return -1;
+  }
+  return commit_one(block_nums, bufs, count);
+}
+
+
+void journal_close() {
+  journal_start = 0;
+  journal_blocks = 0;
+  capacity = 0;
+}
@@ -0,0 +1,64 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "raw_disk.h"
+
+// Write-ahead journal used by basic_file_system.c.  The journal is a region
+// of the disk (set aside by bfs_mkfs()) that a group of block updates goes
+// through on its way home, so that after a crash either all of them or none
+// of them have happened.  It holds at most one transaction: its first block
+// starts with a journal_header, whose list of home block numbers runs on
+// into as many blocks as it needs, and the new contents of the blocks follow
+// in the same order.  A transaction is committed once all of it is on the
+// disk (the checksum tells a torn one apart), and is cleared once every
+// block has been written home.
+
+// "JNL!" in journal_header.magic while a committed transaction is waiting
+#define JOURNAL_MAGIC 0x214c4e4a
+
+struct journal_header {
+  uint32_t magic;           // JOURNAL_MAGIC, or 0 if the journal is empty
+  uint32_t count;           // blocks in the transaction
+  uint64_t checksum;        // FNV-1a over block_nums and then the blocks
+  block_num_t block_nums[]; // home of each block
+};
+
+/* journal_open
+ *   starts using the journal in the given blocks, first replaying the
+ *   transaction it holds, if that was committed
+ * start - first block of the journal
+ * num_blocks - blocks in the journal (at least 2)
+ * returns 0 on success or -1 on failure
+ */
+int journal_open(block_num_t start, uint32_t num_blocks);
+
+/* journal_capacity
+ *   returns the most blocks one transaction can hold
+ */
+uint32_t journal_capacity();
+
+/* journal_blocks_for
+ *   returns the number of journal blocks it takes for transactions of up to
+ *   count blocks (on the mounted disk's block size)
+ */
+uint32_t journal_blocks_for(uint64_t count);
+
+/* journal_commit
+ *   writes blocks home through the journal as one transaction: it is made
+ *   durable first, then the blocks are written home and made durable, then
+ *   the journal is cleared
+ * block_nums - home of each block (no block may appear twice)
+ * bufs - bufs[i] holds the new contents of block block_nums[i]
+ * count - number of entries in block_nums and bufs (at most
+ *   journal_capacity())
+ * returns 0 on success or -1 on failure (nothing is written if count is
+ *   too big)
+ */
+int journal_commit(const block_num_t* block_nums, const void* const* bufs, uint32_t count);
+
+/* journal_close
+ *   stops using the journal (everything committed is already home)
+ */
+void journal_close();
+
+#endif // _JOURNAL_H_
@@ -1,7 +1,9 @@
 #include "jumbo_file_system.h"
+#include "dentry_cache.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 
 // C does not have a bool type, so I created one that you can use
 typedef char bool_t;
@@ -9,322 +11,2621 @@ typedef char bool_t;
 #define FALSE 0
 
 
-static block_num_t current_dir;
+// Every jfs_* function holds fs_lock while it runs: the ones that only look
+// (lookups and reads, which can then run side by side) share it, and the
+// rest hold it alone.  A jfs_* function called by another runs under the
+// outer one's hold.
+#define LOCK_SHARED 0
+#define LOCK_EXCLUSIVE 1
+#define LOCK_LOOKUP 2 // shared, unless an append stream may need flushing
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static __thread int fs_lock_depth = 0;
+static __thread bool_t fs_lock_shared = FALSE;
+static bool_t streams_open();
 
+static int lock_fs(int mode) {
+    if (fs_lock_depth++ > 0){
+        return 0;
+    }
+    if (mode != LOCK_EXCLUSIVE){
+        pthread_rwlock_rdlock(&fs_lock);
+        // (streams only open and close while the lock is held alone)
+        if (mode == LOCK_SHARED || !streams_open()){
+            fs_lock_shared = TRUE;
+            cache_begin_shared();
+            return 0;
+        }
+        pthread_rwlock_unlock(&fs_lock);
+    }
+    pthread_rwlock_wrlock(&fs_lock);
+    fs_lock_shared = FALSE;
+    return 0;
+}
+
+static void unlock_fs(int* held) {
+    (void)held;
+    if (--fs_lock_depth == 0){
+        if (fs_lock_shared){
+            cache_end_shared();
+        }
+        pthread_rwlock_unlock(&fs_lock);
+    }
+}
+
+// holds fs_lock in the given mode until the enclosing function returns
+#define LOCK_FS(mode) \
+    int fs_lock_held __attribute__((cleanup(unlock_fs))) = lock_fs(mode)
+
+// Each thread has a working directory of its own, the root until it calls
+// jfs_chdir().  It only counts for the mount it was set in.  cwd_list holds
+// the working directory of every thread that has one other than the root
+// (under cwd_lock, as jfs_chdir() runs side by side), so jfs_rmdir() can
+// leave them alone.  Their blocks are pinned, as long as that leaves most
+// of the block cache free.
+static __thread block_num_t current_dir;
+static __thread unsigned current_dir_mount = 0;
+static __thread bool_t current_dir_pinned = FALSE;
+static unsigned mount_count = 0; // goes up at every mount and unmount
+static pthread_mutex_t cwd_lock = PTHREAD_MUTEX_INITIALIZER;
+static block_num_t* cwd_list = NULL;
+static size_t cwd_count = 0;
+static size_t cwd_capacity = 0;
+static size_t pinned_cwds = 0;
+
+// whether the mounted disk stores 32-bit block numbers; older disks store
+// 16-bit ones and their nodes are converted on every read and write
+static bool_t wide_block_nums;
+
+// Dirnodes on disks with 16-bit block numbers have no room for their parent,
+// so on those disks it is kept here instead, indexed by dir block.  A
+// directory can only be reached by looking it up in its parent, which is
+// when its parent gets filled in.
+static block_num_t* parent_table = NULL;
+
+// on-disk layout of an inode or dirnode with 16-bit block numbers
+struct block_16 {
+    uint32_t is_dir;
+    union {
+        struct {
+            uint32_t file_size;
+            uint16_t data_blocks[DATA_BLOCKS_16_FOR(MAX_BLOCK_SIZE)];
+        } inode;
+        struct {
+            uint16_t num_entries;
+            struct {
+                uint16_t block_num;
+                char name[MAX_NAME_LENGTH + 1];
+            } entries[DIR_ENTRIES_16_FOR(MAX_BLOCK_SIZE)];
+        } dirnode;
+    } contents;
+};
+
+
+/* read_node
+ *   helper function to read an inode or dirnode into a struct block,
+ *   widening 16-bit block numbers if the disk has them
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int read_node(block_num_t block_num, struct block* node) {
+    if (wide_block_nums) {
+        return cache_read_block(block_num, node);
+    }
+    
+    const struct block_16* old = cache_borrow_block(block_num);
+    if (old == NULL){
+        return -1;
+    }
+    memset(node, 0, NODE_HEADER_SIZE);
+    node->is_dir = old->is_dir;
+    if (old->is_dir == 0){
+        // dir node (a corrupt entry count must not run off the block)
+        uint16_t num_entries = old->contents.dirnode.num_entries;
+        if (num_entries > MAX_DIR_ENTRIES){
+            num_entries = MAX_DIR_ENTRIES;
+        }
+        node->contents.dirnode.num_entries = num_entries;
+        for (int i = 0; i < num_entries; i++){
+            struct dir_entry* entry = &node->contents.dirnode.entries[i];
+            memset(entry, 0, sizeof(struct dir_entry));
+            entry->block_num = old->contents.dirnode.entries[i].block_num;
+            memcpy(entry->name, old->contents.dirnode.entries[i].name, MAX_NAME_LENGTH + 1);
+        }
+    } else {
+        // inode
+        node->contents.inode.file_size = old->contents.inode.file_size;
+        for (size_t i = 0; i < MAX_DATA_BLOCKS; i++){
+            node->contents.inode.data_blocks[i] = old->contents.inode.data_blocks[i];
+        }
+    }
+    return 0;
+}
+
+/* write_node
+ *   helper function to write an inode or dirnode, narrowing its block
+ *   numbers to 16 bits if the disk has them
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int write_node(block_num_t block_num, const struct block* node) {
+    if (wide_block_nums) {
+        return cache_write_block(block_num, node);
+    }
+    
+    struct block_16 old;
+    memset(&old, 0, BLOCK_SIZE);
+    old.is_dir = node->is_dir;
+    if (node->is_dir == 0){
+        // dir node
+        uint16_t num_entries = node->contents.dirnode.num_entries;
+        old.contents.dirnode.num_entries = num_entries;
+        for (int i = 0; i < num_entries; i++){
+            old.contents.dirnode.entries[i].block_num = node->contents.dirnode.entries[i].block_num;
+            memcpy(old.contents.dirnode.entries[i].name,
+                   node->contents.dirnode.entries[i].name, MAX_NAME_LENGTH + 1);
+        }
+    } else {
+        // inode
+        old.contents.inode.file_size = node->contents.inode.file_size;
+        for (size_t i = 0; i < MAX_DATA_BLOCKS; i++){
+            old.contents.inode.data_blocks[i] = node->contents.inode.data_blocks[i];
+        }
+    }
+    return cache_write_block(block_num, &old);
+}
+
+/* borrow_node
+ *   helper function to look at an inode or dirnode without copying it when
+ *   the disk layout allows; otherwise it is converted into scratch
+ *
+ * returns a pointer valid until the next cache call, or NULL on failure
+ */
+static const struct block* borrow_node(block_num_t block_num, struct block* scratch) {
+    if (wide_block_nums) {
+        return cache_borrow_block(block_num);
+    }
+    if (read_node(block_num, scratch) == -1){
+        return NULL;
+    }
+    return scratch;
+}
+
+
+// returns the calling thread's working directory
+static block_num_t cwd() {
+    return (current_dir_mount == mount_count) ? current_dir : bfs_root_block();
+}
+
+// whether dir_block_num is the working directory of any thread
+static bool_t is_any_cwd(block_num_t dir_block_num) {
+    bool_t found = FALSE;
+    pthread_mutex_lock(&cwd_lock);
+    for (size_t i = 0; i < cwd_count && !found; i++){
+        found = (cwd_list[i] == dir_block_num);
+    }
+    pthread_mutex_unlock(&cwd_lock);
+    return found;
+}
+
+// forgets the calling thread's working directory (back to the root)
+static void leave_current_dir() {
+    if (current_dir_mount != mount_count){
+        return;
+    }
+    pthread_mutex_lock(&cwd_lock);
+    for (size_t i = 0; i < cwd_count; i++){
+        if (cwd_list[i] == current_dir){
+            cwd_list[i] = cwd_list[--cwd_count];
+            break;
+        }
+    }
+    if (current_dir_pinned){
+        cache_unpin(current_dir);
+        pinned_cwds--;
+        current_dir_pinned = FALSE;
+    }
+    pthread_mutex_unlock(&cwd_lock);
+    current_dir_mount = 0;
+}
+
+// lets go of an exiting thread's working directory
+static pthread_key_t cwd_key;
+static pthread_once_t cwd_key_once = PTHREAD_ONCE_INIT;
+
+static void exit_current_dir(void* unused) {
+    (void)unused;
+    LOCK_FS(LOCK_SHARED);
+    leave_current_dir();
+}
+
+static void make_cwd_key() {
+    pthread_key_create(&cwd_key, exit_current_dir);
+}
+
+/* set_current_dir
+ *   helper function to move the calling thread's working directory
+ *
+ * returns 0 on success, otherwise returns -1 (the thread is left in the
+ *   root directory)
+ */
+static int set_current_dir(block_num_t block_num) {
+    leave_current_dir();
+    current_dir_pinned = FALSE; // (a pin from an earlier mount is gone)
+    if (block_num == bfs_root_block()){
+        return 0;
+    }
+    pthread_once(&cwd_key_once, make_cwd_key);
+    pthread_setspecific(cwd_key, &current_dir);
+    
+    pthread_mutex_lock(&cwd_lock);
+    bool_t listed = FALSE;
+    if (cwd_count == cwd_capacity){
+        size_t new_capacity = cwd_capacity ? 2 * cwd_capacity : 8;
+        block_num_t* grown = realloc(cwd_list, new_capacity * sizeof(block_num_t));
+        if (grown != NULL){
+            cwd_list = grown;
+            cwd_capacity = new_capacity;
+        }
+    }
+    if (cwd_count < cwd_capacity){
+        cwd_list[cwd_count++] = block_num;
+        listed = TRUE;
+        current_dir = block_num;
+        current_dir_mount = mount_count;
+        if (pinned_cwds < cache_get_capacity() / 4 && cache_pin(block_num) == 0){
+            pinned_cwds++;
+            current_dir_pinned = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&cwd_lock);
+    return listed ? 0 : -1;
+}
 
 // optional helper function you can implement to tell you if a block is a dir node or an inode, return TRUE for dir node, FALSE for inode
 static bool_t is_dir(block_num_t block_num) {
-    // get the block
-    struct block target_block;
-    bzero(&target_block, sizeof(struct block));
-    int ret_temp = read_block(block_num, &target_block);
-    if (ret_temp == -1){
-        return ret_temp;
+    // borrow the block in place; only its type field is needed
+    const struct block* target_block = cache_borrow_block(block_num);
+    if (target_block == NULL){
+        return -1;
     }
     
     // check if dir node
-    return (target_block.is_dir == 0);
+    return (target_block->is_dir == 0);
+}
+
+/* entry_is_dir
+ *   helper function to tell if a directory entry is a directory, from the
+ *   type stored in the entry when there is one, otherwise (entries written
+ *   before types were stored, and disks with 16-bit block numbers) by
+ *   reading the child
+ */
+static bool_t entry_is_dir(uint8_t type, block_num_t block_num) {
+    if (type != ENTRY_TYPE_UNKNOWN){
+        return type == ENTRY_TYPE_DIR;
+    }
+    return is_dir(block_num);
+}
+
+/* name_hash
+ *   helper function to hash a name (FNV-1a); the low bits of the hash pick
+ *   the bucket of a hashed directory that holds the name
+ */
+static uint32_t name_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (const char* c = name; *c != '\0'; c++){
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+// the low depth bits of a hash
+static uint32_t hash_bits(uint32_t hash, uint32_t depth) {
+    return hash & (((uint32_t)1 << depth) - 1);
+}
+
+// how many entries fit in one dir block of the mounted disk
+static size_t dir_block_entries() {
+    return wide_block_nums ? DIR_ENTRIES_FOR(BLOCK_SIZE) : DIR_ENTRIES_16_FOR(BLOCK_SIZE);
+}
+
+/* max_index_depth
+ *   helper function to find how deep a hashed directory's index can get:
+ *   2^depth bucket numbers must fit in the index blocks a head can list
+ */
+static uint32_t max_index_depth() {
+    uint64_t max_buckets = (uint64_t)INDEX_ENTRIES_FOR(BLOCK_SIZE) * DATA_BLOCKS_FOR(BLOCK_SIZE);
+    uint32_t depth = 0;
+    while (depth < 31 && ((uint64_t)2 << depth) <= max_buckets){
+        depth++;
+    }
+    return depth;
+}
+
+/* index_get
+ *   helper function to read one bucket number from a hashed directory's index
+ *
+ * returns the bucket's block num, or 0 on failure
+ */
+static block_num_t index_get(const struct block* head, uint32_t slot) {
+    size_t per_block = INDEX_ENTRIES_FOR(BLOCK_SIZE);
+    const block_num_t* index = cache_borrow_block(head->contents.dirnode.index_blocks[slot / per_block]);
+    if (index == NULL){
+        return 0;
+    }
+    return index[slot % per_block];
+}
+
+/* load_index
+ *   helper function to read a hashed directory's whole index into a malloced
+ *   array of 2^depth bucket numbers, which the caller frees
+ *
+ * returns the array, or NULL on failure
+ */
+static block_num_t* load_index(const struct block* head) {
+    size_t per_block = INDEX_ENTRIES_FOR(BLOCK_SIZE);
+    size_t count = (size_t)1 << head->contents.dirnode.depth;
+    block_num_t* index = malloc(count * sizeof(block_num_t));
+    if (index == NULL){
+        return NULL;
+    }
+    block_num_t index_block[INDEX_ENTRIES_FOR(MAX_BLOCK_SIZE)];
+    for (size_t i = 0; i * per_block < count; i++){
+        if (cache_read_block(head->contents.dirnode.index_blocks[i], index_block) == -1){
+            free(index);
+            return NULL;
+        }
+        size_t n = (count - i * per_block < per_block) ? count - i * per_block : per_block;
+        memcpy(&index[i * per_block], index_block, n * sizeof(block_num_t));
+    }
+    return index;
+}
+
+/* first_slot
+ *   helper function to tell if a slot of a loaded index is the first one
+ *   that points at its bucket.  A bucket that tells apart d bits of the hash
+ *   is in every slot that ends in the same d bits, so a slot repeats the one
+ *   without its highest set bit exactly when that bit is above the bucket's d.
+ */
+static bool_t first_slot(const block_num_t* index, uint32_t slot) {
+    if (slot == 0){
+        return TRUE;
+    }
+    uint32_t high_bit = (uint32_t)1 << (31 - __builtin_clz(slot));
+    return index[slot] != index[slot ^ high_bit];
+}
+
+/* find_name
+ *   helper function to find a name among the entries of one dir block.  A
+ *   stored name fits in a 64-bit word, so each entry costs a single masked
+ *   compare; the mask keeps the name and its '\0' and drops whatever follows
+ *   (older disks don't zero the rest of the field).
+ *
+ * returns the index of the entry, or -1 if it isn't there
+ */
+static int find_name(const struct dir_entry* entries, int num_entries, const char* name) {
+    _Static_assert(MAX_NAME_LENGTH + 1 == sizeof(uint64_t), "a name must fill one word");
+    size_t length = strnlen(name, MAX_NAME_LENGTH + 1);
+    if (length > MAX_NAME_LENGTH){
+        return -1;
+    }
+    char wanted[MAX_NAME_LENGTH + 1] = {0};
+    char keep[MAX_NAME_LENGTH + 1] = {0};
+    memcpy(wanted, name, length);
+    memset(keep, 0xff, length + 1);
+    uint64_t wanted_word, mask;
+    memcpy(&wanted_word, wanted, sizeof(uint64_t));
+    memcpy(&mask, keep, sizeof(uint64_t));
+    
+    for (int i = 0; i < num_entries; i++){
+        uint64_t word;
+        memcpy(&word, entries[i].name, sizeof(uint64_t));
+        if ((word & mask) == wanted_word){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* find_entry
+ *   helper function to look a name up in a directory, hashed or not
+ * dir_block_num: the directory's dir block
+ * found: filled in with a copy of the entry if the name exists
+ * holder: if not NULL, filled in with the block holding the entry (the dir
+ *   block itself, or one of its buckets)
+ *
+ * returns -1 if not exist or error, otherwise the index of the entry in
+ *   its holder's "entries"
+ */
+static int find_entry(block_num_t dir_block_num, const char* name,
+                      struct dir_entry* found, block_num_t* holder) {
+    // borrow the blocks in place instead of copying them
+    struct block scratch;
+    const struct block* node = borrow_node(dir_block_num, &scratch);
+    if (node == NULL){
+        return -1;
+    }
+    block_num_t node_num = dir_block_num;
+    if (node->contents.dirnode.flags & DIR_FLAG_HASHED){
+        // only one bucket can hold the name
+        uint32_t slot = hash_bits(name_hash(name), node->contents.dirnode.depth);
+        node_num = index_get(node, slot);
+        if (node_num == 0){
+            return -1;
+        }
+        node = borrow_node(node_num, &scratch);
+        if (node == NULL){
+            return -1;
+        }
+    }
+    
+    int i = find_name(node->contents.dirnode.entries, node->contents.dirnode.num_entries, name);
+    if (i != -1){
+        *found = node->contents.dirnode.entries[i];
+        if (holder != NULL){
+            *holder = node_num;
+        }
+    }
+    return i;
+}
+
+/* make_hashed
+ *   helper function to turn a full dir block into the head of a hashed
+ *   directory: its entries move to a single bucket, which later inserts
+ *   split as needed
+ *
+ * returns 0 on success, otherwise E_DISK_FULL or E_UNKNOWN
+ */
+static int make_hashed(block_num_t dir_block_num, struct block* head) {
+    block_num_t new_block_nums[2];
+    if (allocate_blocks(2, new_block_nums) != 0){
+        return E_DISK_FULL;
+    }
+    block_num_t bucket_num = new_block_nums[0];
+    block_num_t index_num = new_block_nums[1];
+    
+    // the bucket is a copy of the dir block
+    struct block bucket;
+    memset(&bucket, 0, BLOCK_SIZE);
+    bucket.contents.dirnode.flags = DIR_FLAG_BUCKET;
+    bucket.contents.dirnode.num_entries = head->contents.dirnode.num_entries;
+    memcpy(bucket.contents.dirnode.entries, head->contents.dirnode.entries,
+           head->contents.dirnode.num_entries * sizeof(struct dir_entry));
+    
+    // an index of depth 0 has the one slot
+    block_num_t index[INDEX_ENTRIES_FOR(MAX_BLOCK_SIZE)];
+    memset(index, 0, BLOCK_SIZE);
+    index[0] = bucket_num;
+    
+    if (write_node(bucket_num, &bucket) == -1 || cache_write_block(index_num, index) == -1){
+        release_blocks(new_block_nums, 2);
+        return E_UNKNOWN;
+    }
+    
+    head->contents.dirnode.total_entries = head->contents.dirnode.num_entries;
+    head->contents.dirnode.num_entries = 0;
+    head->contents.dirnode.flags = DIR_FLAG_HASHED;
+    head->contents.dirnode.depth = 0;
+    memset(head->contents.dirnode.entries, 0, BLOCK_SIZE - NODE_HEADER_SIZE);
+    head->contents.dirnode.index_blocks[0] = index_num;
+    if (write_node(dir_block_num, head) == -1){
+        return E_UNKNOWN;
+    }
+    return E_SUCCESS;
+}
+
+/* index_block_count
+ *   helper function to find how many blocks a hashed directory's index
+ *   takes (none for a plain directory)
+ */
+static uint32_t index_block_count(const struct block* head) {
+    if (!(head->contents.dirnode.flags & DIR_FLAG_HASHED)){
+        return 0;
+    }
+    uint64_t count = (uint64_t)1 << head->contents.dirnode.depth;
+    return (count + INDEX_ENTRIES_FOR(BLOCK_SIZE) - 1) / INDEX_ENTRIES_FOR(BLOCK_SIZE);
+}
+
+/* grow_index
+ *   helper function to double a hashed directory's index; the new upper
+ *   half of the slots points at the same buckets as the lower half
+ *
+ * returns 0 on success, otherwise E_MAX_DIR_ENTRIES, E_DISK_FULL or E_UNKNOWN
+ */
+static int grow_index(block_num_t dir_block_num, struct block* head) {
+    uint32_t depth = head->contents.dirnode.depth;
+    if (depth >= max_index_depth()){
+        return E_MAX_DIR_ENTRIES;
+    }
+    size_t per_block = INDEX_ENTRIES_FOR(BLOCK_SIZE);
+    size_t count = (size_t)1 << depth;
+    block_num_t index[INDEX_ENTRIES_FOR(MAX_BLOCK_SIZE)];
+    
+    if (2 * count <= per_block){
+        // still fits in the first index block
+        block_num_t index_num = head->contents.dirnode.index_blocks[0];
+        if (cache_read_block(index_num, index) == -1){
+            return E_UNKNOWN;
+        }
+        memcpy(&index[count], index, count * sizeof(block_num_t));
+        if (cache_write_block(index_num, index) == -1){
+            return E_UNKNOWN;
+        }
+    } else {
+        // copy every index block (both counts are powers of two, so the
+        // old index fills whole blocks)
+        size_t old_blocks = count / per_block;
+        block_num_t* new_block_nums = malloc(old_blocks * sizeof(block_num_t));
+        if (new_block_nums == NULL){
+            return E_UNKNOWN;
+        }
+        if (allocate_blocks(old_blocks, new_block_nums) != 0){
+            free(new_block_nums);
+            return E_DISK_FULL;
+        }
+        for (size_t i = 0; i < old_blocks; i++){
+            if (cache_read_block(head->contents.dirnode.index_blocks[i], index) == -1 ||
+                cache_write_block(new_block_nums[i], index) == -1){
+                release_blocks(new_block_nums, old_blocks);
+                free(new_block_nums);
+                return E_UNKNOWN;
+            }
+        }
+        for (size_t i = 0; i < old_blocks; i++){
+            head->contents.dirnode.index_blocks[old_blocks + i] = new_block_nums[i];
+        }
+        free(new_block_nums);
+    }
+    
+    head->contents.dirnode.depth++;
+    if (write_node(dir_block_num, head) == -1){
+        return E_UNKNOWN;
+    }
+    return E_SUCCESS;
+}
+
+/* point_slots
+ *   helper function for split_bucket(): points every slot of the index that
+ *   ends in the same depth + 1 bits as slot, with bit depth set, at target,
+ *   one index block at a time
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int point_slots(const struct block* head, uint32_t slot, uint32_t depth,
+                       block_num_t target) {
+    size_t per_block = INDEX_ENTRIES_FOR(BLOCK_SIZE);
+    uint64_t count = (uint64_t)1 << head->contents.dirnode.depth;
+    uint64_t step = (uint64_t)1 << (depth + 1);
+    block_num_t index[INDEX_ENTRIES_FOR(MAX_BLOCK_SIZE)];
+    size_t loaded = SIZE_MAX;
+    for (uint64_t i = hash_bits(slot, depth) | ((uint32_t)1 << depth); i < count; i += step){
+        size_t index_block = i / per_block;
+        if (index_block != loaded){
+            if (loaded != SIZE_MAX &&
+                cache_write_block(head->contents.dirnode.index_blocks[loaded], index) == -1){
+                return -1;
+            }
+            if (cache_read_block(head->contents.dirnode.index_blocks[index_block], index) == -1){
+                return -1;
+            }
+            loaded = index_block;
+        }
+        index[i % per_block] = target;
+    }
+    return cache_write_block(head->contents.dirnode.index_blocks[loaded], index);
+}
+
+/* split_bucket
+ *   helper function to split a full bucket in two: the entries whose hash
+ *   has the next bit set move to a new bucket, and the index slots ending in
+ *   that bit pattern are pointed at it.  The head's index must already be
+ *   deeper than the bucket.  On failure the bucket (and its slots) are put
+ *   back as they were, as far as the disk allows, and the new bucket's
+ *   block is released.
+ * slot: any slot of the index that points at the bucket
+ *
+ * returns 0 on success, otherwise E_DISK_FULL or E_UNKNOWN
+ */
+static int split_bucket(const struct block* head, block_num_t bucket_num,
+                        struct block* bucket, uint32_t slot) {
+    block_num_t sibling_num = allocate_block();
+    if (sibling_num == 0){
+        return E_DISK_FULL;
+    }
+    
+    struct block original = *bucket;
+    uint32_t depth = bucket->contents.dirnode.depth;
+    struct block sibling;
+    memset(&sibling, 0, BLOCK_SIZE);
+    sibling.contents.dirnode.flags = DIR_FLAG_BUCKET;
+    sibling.contents.dirnode.depth = depth + 1;
+    bucket->contents.dirnode.depth = depth + 1;
+    
+    uint16_t kept = 0;
+    for (int i = 0; i < bucket->contents.dirnode.num_entries; i++){
+        struct dir_entry* entry = &bucket->contents.dirnode.entries[i];
+        if ((name_hash(entry->name) >> depth) & 1){
+            sibling.contents.dirnode.entries[sibling.contents.dirnode.num_entries++] = *entry;
+        } else {
+            bucket->contents.dirnode.entries[kept++] = *entry;
+        }
+    }
+    memset(&bucket->contents.dirnode.entries[kept], 0,
+           (bucket->contents.dirnode.num_entries - kept) * sizeof(struct dir_entry));
+    bucket->contents.dirnode.num_entries = kept;
+    
+    if (write_node(sibling_num, &sibling) == -1 || write_node(bucket_num, bucket) == -1 ||
+        point_slots(head, slot, depth, sibling_num) == -1){
+        *bucket = original;
+        write_node(bucket_num, bucket);
+        point_slots(head, slot, depth, bucket_num);
+        release_block(sibling_num);
+        return E_UNKNOWN;
+    }
+    return E_SUCCESS;
+}
+
+/* add_entry
+ *   helper function to add an entry to a directory, turning it into a hashed
+ *   directory once its dir block is full (only on disks with 32-bit block
+ *   numbers) and splitting buckets of a hashed one as they fill up
+ *
+ * returns 0 on success, otherwise E_MAX_DIR_ENTRIES, E_DISK_FULL or E_UNKNOWN
+ */
+static int add_entry(block_num_t dir_block_num, const struct dir_entry* entry) {
+    struct block head;
+    if (read_node(dir_block_num, &head) == -1){
+        return E_UNKNOWN;
+    }
+    
+    if (!(head.contents.dirnode.flags & DIR_FLAG_HASHED)){
+        if (head.contents.dirnode.num_entries < dir_block_entries()){
+            head.contents.dirnode.entries[head.contents.dirnode.num_entries++] = *entry;
+            return write_node(dir_block_num, &head) == -1 ? E_UNKNOWN : E_SUCCESS;
+        }
+        if (!wide_block_nums){
+            return E_MAX_DIR_ENTRIES;
+        }
+        int ret = make_hashed(dir_block_num, &head);
+        if (ret != E_SUCCESS){
+            return ret;
+        }
+    }
+    
+    uint32_t hash = name_hash(entry->name);
+    struct block bucket;
+    while (TRUE){
+        uint32_t slot = hash_bits(hash, head.contents.dirnode.depth);
+        block_num_t bucket_num = index_get(&head, slot);
+        if (bucket_num == 0 || read_node(bucket_num, &bucket) == -1){
+            return E_UNKNOWN;
+        }
+        
+        if (bucket.contents.dirnode.num_entries < DIR_ENTRIES_FOR(BLOCK_SIZE)){
+            bucket.contents.dirnode.entries[bucket.contents.dirnode.num_entries++] = *entry;
+            head.contents.dirnode.total_entries++;
+            if (write_node(bucket_num, &bucket) == -1 || write_node(dir_block_num, &head) == -1){
+                return E_UNKNOWN;
+            }
+            return E_SUCCESS;
+        }
+        
+        // the bucket is full: split it (deepening the index first if the
+        // bucket already uses every bit of it) and try again
+        int ret = E_SUCCESS;
+        if (bucket.contents.dirnode.depth >= head.contents.dirnode.depth){
+            // the copied index, the slots split_bucket() repoints, the head,
+            // the bucket and its sibling all go in the same transaction (an
+            // index too big for any transaction can't grow)
+            uint32_t need = 2 * index_block_count(&head) + 3;
+            if (bfs_reserve(need, need) == -1){
+                return E_UNKNOWN;
+            }
+            if (bfs_room() < need){
+                return E_MAX_DIR_ENTRIES;
+            }
+            ret = grow_index(dir_block_num, &head);
+        }
+        if (ret == E_SUCCESS){
+            ret = split_bucket(&head, bucket_num, &bucket, slot);
+        }
+        if (ret != E_SUCCESS){
+            return ret;
+        }
+    }
+}
+
+/* add_entry_cost
+ *   helper function to find the most blocks adding an entry to a directory
+ *   changes (and allocates), together with the new node, if the index has
+ *   to grow once on the way; the caller makes room for them with
+ *   bfs_reserve() before it allocates anything
+ */
+static uint32_t add_entry_cost(block_num_t dir_block_num) {
+    struct block head;
+    if (read_node(dir_block_num, &head) == -1){
+        return 0;
+    }
+    return 2 * index_block_count(&head) + 8;
+}
+
+/* make_unhashed
+ *   helper function to turn an empty hashed directory back into a plain
+ *   dir block, releasing its buckets and index blocks
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int make_unhashed(block_num_t dir_block_num, struct block* head) {
+    block_num_t* index = load_index(head);
+    if (index == NULL){
+        return -1;
+    }
+    uint32_t count = (uint32_t)1 << head->contents.dirnode.depth;
+    int num_buckets = 0;
+    for (uint32_t i = 0; i < count; i++){
+        if (first_slot(index, i)){
+            // the buckets gather at the front of the array
+            index[num_buckets++] = index[i];
+        }
+    }
+    size_t per_block = INDEX_ENTRIES_FOR(BLOCK_SIZE);
+    int num_index_blocks = (count + per_block - 1) / per_block;
+    int ret = release_blocks(index, num_buckets);
+    if (ret == 0){
+        ret = release_blocks(head->contents.dirnode.index_blocks, num_index_blocks);
+    }
+    free(index);
+    if (ret != 0){
+        return -1;
+    }
+    
+    block_num_t parent = head->contents.dirnode.parent;
+    memset(&head->contents, 0, BLOCK_SIZE - sizeof(head->is_dir));
+    head->contents.dirnode.parent = parent;
+    return write_node(dir_block_num, head);
+}
+
+/* remove_entry
+ *   helper function to remove a name from a directory; the last entry of the
+ *   block holding it moves into its place
+ * removed: filled in with a copy of the removed entry
+ *
+ * returns 0 on success, or -1 if the name doesn't exist or on error
+ */
+static int remove_entry(block_num_t dir_block_num, const char* name, struct dir_entry* removed) {
+    block_num_t holder_num;
+    int index = find_entry(dir_block_num, name, removed, &holder_num);
+    if (index == -1){
+        return -1;
+    }
+    
+    struct block holder;
+    if (read_node(holder_num, &holder) == -1){
+        return -1;
+    }
+    uint16_t last = holder.contents.dirnode.num_entries - 1;
+    holder.contents.dirnode.entries[index] = holder.contents.dirnode.entries[last];
+    memset(&holder.contents.dirnode.entries[last], 0, sizeof(struct dir_entry));
+    holder.contents.dirnode.num_entries--;
+    if (write_node(holder_num, &holder) == -1){
+        return -1;
+    }
+    if (holder_num == dir_block_num){
+        return 0;
+    }
+    
+    // a bucket: the head keeps the count
+    if (read_node(dir_block_num, &holder) == -1){
+        return -1;
+    }
+    if (--holder.contents.dirnode.total_entries == 0){
+        return make_unhashed(dir_block_num, &holder);
+    }
+    return write_node(dir_block_num, &holder);
+}
+
+/* for_each_entry
+ *   helper function to call fn on every entry of a directory, reading each
+ *   of its blocks once; fn returns 0 to go on
+ *
+ * returns 0 once every entry is visited, the first nonzero value fn
+ *   returns, or -1 on error
+ */
+static int for_each_entry(block_num_t dir_block_num,
+                          int (*fn)(const struct dir_entry* entry, void* arg), void* arg) {
+    struct block node;
+    if (read_node(dir_block_num, &node) == -1){
+        return -1;
+    }
+    if (!(node.contents.dirnode.flags & DIR_FLAG_HASHED)){
+        for (int i = 0; i < node.contents.dirnode.num_entries; i++){
+            int ret = fn(&node.contents.dirnode.entries[i], arg);
+            if (ret != 0){
+                return ret;
+            }
+        }
+        return 0;
+    }
+    
+    block_num_t* index = load_index(&node);
+    if (index == NULL){
+        return -1;
+    }
+    uint32_t count = (uint32_t)1 << node.contents.dirnode.depth;
+    int ret = 0;
+    for (uint32_t slot = 0; slot < count && ret == 0; slot++){
+        if (!first_slot(index, slot)){
+            continue;
+        }
+        if (read_node(index[slot], &node) == -1){
+            ret = -1;
+            break;
+        }
+        for (int i = 0; i < node.contents.dirnode.num_entries && ret == 0; i++){
+            ret = fn(&node.contents.dirnode.entries[i], arg);
+        }
+    }
+    free(index);
+    return ret;
+}
+
+/* count_entries
+ *   helper function to count the entries of a directory
+ *
+ * returns the count, or -1 on failure
+ */
+static int64_t count_entries(block_num_t dir_block_num) {
+    struct block scratch;
+    const struct block* node = borrow_node(dir_block_num, &scratch);
+    if (node == NULL){
+        return -1;
+    }
+    if (node->contents.dirnode.flags & DIR_FLAG_HASHED){
+        return node->contents.dirnode.total_entries;
+    }
+    return node->contents.dirnode.num_entries;
+}
+
+/* dir_is_full
+ *   helper function to tell if a directory can't take another entry at all
+ *   (a full dir block on disks with 16-bit block numbers; on other disks it
+ *   would become hashed instead)
+ */
+static bool_t dir_is_full(block_num_t dir_block_num) {
+    if (wide_block_nums){
+        return FALSE;
+    }
+    return count_entries(dir_block_num) >= (int64_t)dir_block_entries();
+}
+
+/* parent_of
+ *   helper function to find the parent of a directory (the root is its own)
+ *
+ * returns the parent's dir block, or 0 on failure
+ */
+static block_num_t parent_of(block_num_t dir_block_num) {
+    if (dir_block_num == bfs_root_block()){
+        return dir_block_num;
+    }
+    if (!wide_block_nums){
+        // (filled in by lookups, which may run in several threads at once)
+        return __atomic_load_n(&parent_table[dir_block_num], __ATOMIC_RELAXED);
+    }
+    const struct block* node = cache_borrow_block(dir_block_num);
+    if (node == NULL){
+        return 0;
+    }
+    return node->contents.dirnode.parent;
+}
+
+// notes where a directory was found, for parent_of() on disks whose
+// dirnodes can't say
+static void remember_parent(block_num_t dir_block_num, block_num_t parent) {
+    if (!wide_block_nums){
+        __atomic_store_n(&parent_table[dir_block_num], parent, __ATOMIC_RELAXED);
+    }
+}
+
+/* if_exist
+ *   helper function to see if a "name" exists in a directory; the dentry
+ *   cache answers repeated lookups (including ones for names that don't
+ *   exist) without reading anything
+ *
+ * dir_block_num: the directory to look in
+ * name: the name of a dir or file
+ * target: filled in with the entry's block and type if the name exists
+ * 
+ * returns -1 if not exist or error, otherwise 0
+ */ 
+static int if_exist(block_num_t dir_block_num, const char* target_name, struct dentry* target) {
+    // names that are too long can't be in any directory
+    if (strlen(target_name) > MAX_NAME_LENGTH){
+        return -1;
+    }
+    
+    int cached = dcache_lookup(dir_block_num, target_name, target);
+    if (cached == DCACHE_HIT){
+        if (target->is_dir){
+            remember_parent(target->child, dir_block_num);
+        }
+        return 0;
+    } else if (cached == DCACHE_NEGATIVE){
+        return -1;
+    }
+    
+    struct dir_entry entry;
+    if (find_entry(dir_block_num, target_name, &entry, NULL) == -1){
+        dcache_insert_negative(dir_block_num, target_name);
+        return -1;
+    }
+    // remember what it is for next time
+    target->parent = dir_block_num;
+    target->child = entry.block_num;
+    target->is_dir = entry_is_dir(entry.type, entry.block_num);
+    dcache_insert(dir_block_num, target_name, target->child, target->is_dir);
+    if (target->is_dir){
+        remember_parent(target->child, dir_block_num);
+    }
+    return 0;
+}
+/* remove_directory_entry
+ *   helper function to remove the named entry from a directory:
+ *   release the deleted block, update the meta data of the directory
+ * dir_block_num: the directory holding the entry
+ * name: the name of the entry
+ *
+ * returns 0 on failure, otherwise returns the block num of the inode or dir block
+ *   of the deleted entry
+ */
+static block_num_t remove_directory_entry(block_num_t dir_block_num, const char* name){
+    
+    //	Remove entry from the directory
+    struct dir_entry removed;
+    if (remove_entry(dir_block_num, name, &removed) == -1){
+        return 0;
+    }
+    dcache_insert_negative(dir_block_num, name);
+    
+    // release the target block (to be deleted)
+    block_num_t target_block_num = removed.block_num;
+    int ret_temp = release_block(target_block_num);
+    if (ret_temp == -1){
+        //release failed
+        return 0;
+    }
+    
+    // clean up the target block
+    // by write a new empty block back
+    struct block new_block;
+    bzero(&new_block, sizeof(struct block));
+    cache_write_block(target_block_num, &new_block); 
+    bfs_set_inode_count(bfs_inode_count() - 1);
+    
+    
+    return target_block_num;
+}
+
+// what a path names: a name in a directory, or a directory itself
+struct path_target {
+    block_num_t dir;                // the directory holding the name (or named)
+    char name[MAX_NAME_LENGTH + 1]; // the last component of the path
+    bool_t is_dir_itself;           // the path ends in "." or "..", or is "/"
+};
+
+// The directory part of the last path walked and where it led.  A path
+// starting with the same directories picks up the walk from there, so
+// working in one deep directory costs no more than working in the current
+// one.  Each thread keeps its own; rmdir() makes every thread forget theirs,
+// since the walk may have gone through the removed directory.
+#define WALK_CACHE_LENGTH 128
+static __thread struct {
+    block_num_t start; // root or current directory the walk began in (0 if none)
+    unsigned generation; // walk_generation when it was walked
+    size_t length;
+    char prefix[WALK_CACHE_LENGTH];
+    block_num_t dir;
+} last_walk;
+static unsigned walk_generation = 0;
+
+/* walk_dirs
+ *   helper function to follow the first length characters of a path, all
+ *   of which must be directories, from start
+ * dir: set to the directory the walk ends in
+ *
+ * returns 0 on success, otherwise E_NOT_EXISTS, E_NOT_DIR or E_UNKNOWN
+ */
+static int walk_dirs(const char* path, size_t length, block_num_t start, block_num_t* dir) {
+    block_num_t walked = start;
+    size_t pos = 0;
+    if (last_walk.start == start && last_walk.generation == walk_generation &&
+        last_walk.length <= length &&
+        memcmp(last_walk.prefix, path, last_walk.length) == 0 &&
+        (last_walk.length == length || path[last_walk.length] == '/')){
+        walked = last_walk.dir;
+        pos = last_walk.length;
+    }
+    
+    while (pos < length){
+        size_t end = pos;
+        while (end < length && path[end] != '/'){
+            end++;
+        }
+        size_t name_length = end - pos;
+        if (name_length == 2 && path[pos] == '.' && path[pos + 1] == '.'){
+            walked = parent_of(walked);
+            if (walked == 0){
+                return E_UNKNOWN;
+            }
+        } else if (name_length > 0 && !(name_length == 1 && path[pos] == '.')){
+            // names that are too long can't be in any directory
+            if (name_length > MAX_NAME_LENGTH){
+                return E_NOT_EXISTS;
+            }
+            char name[MAX_NAME_LENGTH + 1];
+            memcpy(name, &path[pos], name_length);
+            name[name_length] = '\0';
+            struct dentry entry;
+            if (if_exist(walked, name, &entry) == -1){
+                return E_NOT_EXISTS;
+            }
+            if (!entry.is_dir){
+                return E_NOT_DIR;
+            }
+            walked = entry.child;
+        }
+        pos = end + 1;
+    }
+    
+    if (length < WALK_CACHE_LENGTH){
+        last_walk.start = start;
+        last_walk.generation = walk_generation;
+        last_walk.length = length;
+        memcpy(last_walk.prefix, path, length);
+        last_walk.dir = walked;
+    }
+    *dir = walked;
+    return E_SUCCESS;
+}
+
+/* resolve_path
+ *   helper function to find the directory a path's last component is in
+ *   (see jumbo_file_system.h for what paths look like)
+ *
+ * returns 0 on success, otherwise E_NOT_EXISTS, E_NOT_DIR, E_UNKNOWN, or
+ *   E_MAX_NAME_LENGTH if only the last component is too long
+ */
+static int resolve_path(const char* path, struct path_target* target) {
+    // trailing slashes don't change what a path names
+    size_t length = strlen(path);
+    while (length > 1 && path[length - 1] == '/'){
+        length--;
+    }
+    if (length == 0){
+        return E_NOT_EXISTS;
+    }
+    block_num_t start = (path[0] == '/') ? bfs_root_block() : cwd();
+    if (length == 1 && path[0] == '/'){
+        target->dir = start;
+        strcpy(target->name, "/");
+        target->is_dir_itself = TRUE;
+        return E_SUCCESS;
+    }
+    
+    // split off the last component, and walk up to it
+    size_t last = length;
+    while (last > 0 && path[last - 1] != '/'){
+        last--;
+    }
+    int ret = walk_dirs(path, (last > 0) ? last - 1 : 0, start, &target->dir);
+    if (ret != E_SUCCESS){
+        return ret;
+    }
+    size_t name_length = length - last;
+    if (name_length > MAX_NAME_LENGTH){
+        return E_MAX_NAME_LENGTH;
+    }
+    memcpy(target->name, &path[last], name_length);
+    target->name[name_length] = '\0';
+    
+    target->is_dir_itself = FALSE;
+    if (strcmp(target->name, ".") == 0){
+        target->is_dir_itself = TRUE;
+    } else if (strcmp(target->name, "..") == 0){
+        target->dir = parent_of(target->dir);
+        if (target->dir == 0){
+            return E_UNKNOWN;
+        }
+        target->is_dir_itself = TRUE;
+    }
+    return E_SUCCESS;
+}
+
+/* find_path
+ *   helper function to find the file or directory a path names
+ * target: filled in by resolve_path()
+ * found: filled in with the entry's block and type
+ *
+ * returns 0 on success, otherwise E_NOT_EXISTS, E_NOT_DIR or E_UNKNOWN
+ */
+static int find_path(const char* path, struct path_target* target, struct dentry* found) {
+    int ret = resolve_path(path, target);
+    if (ret == E_MAX_NAME_LENGTH){
+        // such a name can't exist
+        return E_NOT_EXISTS;
+    } else if (ret != E_SUCCESS){
+        return ret;
+    }
+    if (target->is_dir_itself){
+        found->parent = 0; // not needed
+        found->child = target->dir;
+        found->is_dir = TRUE;
+        return E_SUCCESS;
+    }
+    if (if_exist(target->dir, target->name, found) == -1){
+        return E_NOT_EXISTS;
+    }
+    return E_SUCCESS;
+}
+
+/* extent_map
+ *   helper function to find the disk blocks behind count blocks of a file,
+ *   starting at file block first, walking only the part of an extent tree
+ *   that covers them
+ * header / records: a node of the tree (its root, at first)
+ * block_nums: receives the disk block numbers
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int extent_map(const struct extent_header* header, const struct extent* records,
+                      uint32_t first, uint32_t count, block_num_t* block_nums) {
+    uint32_t end = first + count;
+    for (int i = 0; i < header->num_entries && records[i].logical < end; i++){
+        const struct extent* record = &records[i];
+        if (header->depth == 0){
+            uint32_t from = (record->logical > first) ? record->logical : first;
+            uint32_t to = (record->logical + record->length < end) ?
+                record->logical + record->length : end;
+            for (uint32_t b = from; b < to; b++){
+                block_nums[b - first] = record->start + (b - record->logical);
+            }
+        } else {
+            // a child covers the blocks up to where the next child starts
+            if (i + 1 < header->num_entries && records[i + 1].logical <= first){
+                continue;
+            }
+            struct extent_block child;
+            if (cache_read_block(record->start, &child) == -1 ||
+                extent_map(&child.header, child.records, first, count, block_nums) == -1){
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* extent_release
+ *   helper function to release every data block an extent tree node covers,
+ *   and the tree blocks below it
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int extent_release(const struct extent_header* header, const struct extent* records) {
+    int ret = 0;
+    for (int i = 0; i < header->num_entries; i++){
+        if (header->depth == 0){
+            if (release_extent(records[i].start, records[i].length) == -1){
+                ret = -1;
+            }
+            continue;
+        }
+        struct extent_block child;
+        if (cache_read_block(records[i].start, &child) == -1 ||
+            extent_release(&child.header, child.records) == -1 ||
+            release_block(records[i].start) == -1){
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* extent_leaf_room
+ *   helper function to find how many more extents fit in the last leaf of
+ *   an extent tree (the only one extents are ever added to)
+ *
+ * returns the number, or -1 on failure
+ */
+static int64_t extent_leaf_room(const struct extent_header* header, const struct extent* records) {
+    if (header->depth == 0){
+        return EXTENTS_FOR(BLOCK_SIZE) - header->num_entries;
+    }
+    struct extent_block child;
+    if (cache_read_block(records[header->num_entries - 1].start, &child) == -1){
+        return -1;
+    }
+    return extent_leaf_room(&child.header, child.records);
+}
+
+// What appending to an extent tree changed, so a failed append can be
+// undone: the tree blocks it allocated, and the blocks on the tree's last
+// path (the only ones that existed before and can change) as they were.
+struct extent_undo {
+    uint32_t num_saved;
+    block_num_t* saved_nums;
+    struct extent_block* saved;
+    uint32_t num_allocated;
+    uint32_t allocated_capacity;
+    block_num_t* allocated;
+};
+
+/* extent_save_path
+ *   helper function to remember the blocks on the last path of an extent
+ *   tree before anything is appended to it
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int extent_save_path(const struct extent_header* root, const struct extent* root_records,
+                            struct extent_undo* undo) {
+    undo->saved_nums = malloc(root->depth * sizeof(block_num_t));
+    undo->saved = malloc(root->depth * sizeof(struct extent_block));
+    if (root->depth > 0 && (undo->saved_nums == NULL || undo->saved == NULL)){
+        return -1;
+    }
+    const struct extent_header* header = root;
+    const struct extent* records = root_records;
+    while (header->depth > 0){
+        block_num_t child_num = records[header->num_entries - 1].start;
+        struct extent_block* child = &undo->saved[undo->num_saved];
+        if (cache_read_block(child_num, child) == -1){
+            return -1;
+        }
+        undo->saved_nums[undo->num_saved++] = child_num;
+        header = &child->header;
+        records = child->records;
+    }
+    return 0;
+}
+
+/* extent_allocate
+ *   helper function to allocate a block for an extent tree node, noting it
+ *   in undo
+ *
+ * returns the block number, or 0 on failure
+ */
+static block_num_t extent_allocate(struct extent_undo* undo) {
+    if (undo->num_allocated == undo->allocated_capacity){
+        uint32_t new_capacity = undo->allocated_capacity ? 2 * undo->allocated_capacity : 8;
+        block_num_t* grown = realloc(undo->allocated, new_capacity * sizeof(block_num_t));
+        if (grown == NULL){
+            return 0;
+        }
+        undo->allocated = grown;
+        undo->allocated_capacity = new_capacity;
+    }
+    block_num_t block_num = allocate_block();
+    if (block_num != 0){
+        undo->allocated[undo->num_allocated++] = block_num;
+    }
+    return block_num;
+}
+
+/* extent_undo
+ *   helper function to put the tree blocks an append changed back the way
+ *   they were and release the ones it allocated
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int extent_undo(const struct extent_undo* undo) {
+    int ret = 0;
+    for (uint32_t i = 0; i < undo->num_saved; i++){
+        if (cache_write_block(undo->saved_nums[i], &undo->saved[i]) == -1){
+            ret = -1;
+        }
+    }
+    if (release_blocks(undo->allocated, undo->num_allocated) == -1){
+        ret = -1;
+    }
+    return ret;
+}
+
+// frees what an extent_undo holds
+static void extent_undo_free(struct extent_undo* undo) {
+    free(undo->saved_nums);
+    free(undo->saved);
+    free(undo->allocated);
+}
+
+/* extent_append_at
+ *   helper function to add an extent at the end of the subtree under an
+ *   extent tree node, merging it into the last extent when it continues it
+ * record: the extent
+ * sibling: set to a new node at the same depth as this one, holding the
+ *   path down to the extent, when this node was full
+ * undo: where the new node is noted
+ *
+ * returns 0 when the extent was added under this node, 1 when it was added
+ *   under *sibling instead, otherwise returns -1
+ */
+static int extent_append_at(struct extent_header* header, struct extent* records,
+                            const struct extent* record, block_num_t* sibling,
+                            struct extent_undo* undo) {
+    struct extent to_add = *record;
+    if (header->depth == 0){
+        if (header->num_entries > 0){
+            struct extent* last = &records[header->num_entries - 1];
+            if (last->logical + last->length == record->logical &&
+                last->start + last->length == record->start){
+                last->length += record->length;
+                return 0;
+            }
+        }
+    } else {
+        block_num_t child_num = records[header->num_entries - 1].start;
+        struct extent_block child;
+        if (cache_read_block(child_num, &child) == -1){
+            return -1;
+        }
+        block_num_t child_sibling;
+        int ret = extent_append_at(&child.header, child.records, record, &child_sibling, undo);
+        if (ret == 0){
+            return cache_write_block(child_num, &child);
+        } else if (ret == -1){
+            return -1;
+        }
+        // the child was full: point at its new sibling from here instead
+        to_add.length = 0;
+        to_add.start = child_sibling;
+    }
+    
+    if (header->num_entries < EXTENTS_FOR(BLOCK_SIZE)){
+        records[header->num_entries++] = to_add;
+        return 0;
+    }
+    
+    // full as well: start a sibling holding just the new record
+    block_num_t sibling_num = extent_allocate(undo);
+    if (sibling_num == 0){
+        return -1;
+    }
+    struct extent_block node;
+    memset(&node, 0, BLOCK_SIZE);
+    node.header.depth = header->depth;
+    node.header.num_entries = 1;
+    node.records[0] = to_add;
+    if (cache_write_block(sibling_num, &node) == -1){
+        return -1;
+    }
+    *sibling = sibling_num;
+    return 1;
+}
+
+/* extent_append
+ *   helper function to add the length disk blocks from start to the end of a
+ *   file's extent tree, as its blocks from logical on; when the root in the
+ *   inode is full, its records move down into a new node and the tree gets
+ *   one level deeper
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int extent_append(struct block* inode_block, uint32_t logical,
+                         block_num_t start, uint32_t length, struct extent_undo* undo) {
+    struct extent_header* root = &inode_block->contents.inode.extent_header;
+    struct extent* root_records = inode_block->contents.inode.extents;
+    struct extent record = {logical, length, start};
+    block_num_t sibling_num;
+    int ret = extent_append_at(root, root_records, &record, &sibling_num, undo);
+    if (ret != 1){
+        return ret;
+    }
+    
+    block_num_t moved_num = extent_allocate(undo);
+    if (moved_num == 0){
+        return -1;
+    }
+    struct extent_block moved;
+    memset(&moved, 0, BLOCK_SIZE);
+    moved.header = *root;
+    memcpy(moved.records, root_records, root->num_entries * sizeof(struct extent));
+    if (cache_write_block(moved_num, &moved) == -1){
+        return -1;
+    }
+    
+    memset(root_records, 0, EXTENTS_FOR(BLOCK_SIZE) * sizeof(struct extent));
+    root_records[0].logical = 0;
+    root_records[0].start = moved_num;
+    root_records[1].logical = logical;
+    root_records[1].start = sibling_num;
+    root->num_entries = 2;
+    root->depth++;
+    return 0;
+}
+
+// number of runs of consecutive disk blocks in a list
+static uint32_t count_runs(const block_num_t* block_nums, uint32_t count) {
+    uint32_t runs = 0;
+    for (uint32_t i = 0; i < count; i++){
+        if (i == 0 || block_nums[i] != block_nums[i - 1] + 1){
+            runs++;
+        }
+    }
+    return runs;
+}
+
+// adds a list of disk blocks to a file's extent tree, one extent per run,
+// as its blocks from logical on
+static int extent_append_list(struct block* inode_block, uint32_t logical,
+                              const block_num_t* block_nums, uint32_t count,
+                              struct extent_undo* undo) {
+    uint32_t i = 0;
+    while (i < count){
+        uint32_t length = 1;
+        while (i + length < count && block_nums[i + length] == block_nums[i] + length){
+            length++;
+        }
+        if (extent_append(inode_block, logical + i, block_nums[i], length, undo) == -1){
+            return -1;
+        }
+        i += length;
+    }
+    return 0;
+}
+
+/* file_block_nums
+ *   helper function to find the disk blocks behind count blocks of a file,
+ *   starting at file block first, from its extent tree or its direct list
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int file_block_nums(const struct block* inode_block, uint32_t first, uint32_t count,
+                           block_num_t* block_nums) {
+    if (inode_block->contents.inode.flags & INODE_FLAG_EXTENTS){
+        return extent_map(&inode_block->contents.inode.extent_header,
+                          inode_block->contents.inode.extents, first, count, block_nums);
+    }
+    memcpy(block_nums, &inode_block->contents.inode.data_blocks[first], count * sizeof(block_num_t));
+    return 0;
+}
+
+/* add_file_blocks
+ *   helper function to record newly allocated data blocks at the end of a
+ *   file.  On disks with 32-bit block numbers a file that still lists its
+ *   blocks directly gets an extent tree first.
+ * inode_block: the file's inode (the caller writes it)
+ * cur_block_amount: number of data blocks the file has now
+ * undo: filled in with what the extent tree changed (see extent_undo())
+ *
+ * returns 0 on success, -2 if the extent tree might not find the blocks it
+ *   needs (nothing is changed then), otherwise returns -1
+ */
+static int add_file_blocks(struct block* inode_block, uint32_t cur_block_amount,
+                           const block_num_t* new_block_nums, uint32_t count,
+                           struct extent_undo* undo) {
+    if (!wide_block_nums){
+        memcpy(&inode_block->contents.inode.data_blocks[cur_block_amount], new_block_nums,
+               count * sizeof(block_num_t));
+        return 0;
+    }
+    
+    struct extent_header* root = &inode_block->contents.inode.extent_header;
+    bool_t convert = !(inode_block->contents.inode.flags & INODE_FLAG_EXTENTS);
+    block_num_t old_block_nums[DATA_BLOCKS_FOR(MAX_BLOCK_SIZE)];
+    uint32_t runs = count_runs(new_block_nums, count);
+    int64_t room;
+    uint32_t depth;
+    if (convert){
+        memcpy(old_block_nums, inode_block->contents.inode.data_blocks,
+               cur_block_amount * sizeof(block_num_t));
+        runs += count_runs(old_block_nums, cur_block_amount);
+        room = EXTENTS_FOR(BLOCK_SIZE);
+        depth = 0;
+    } else {
+        room = extent_leaf_room(root, inode_block->contents.inode.extents);
+        if (room == -1){
+            return -1;
+        }
+        depth = root->depth;
+    }
+    
+    // make sure the tree can't run out of blocks halfway: at worst every
+    // level of the last path fills up once per leaf of new extents, and the
+    // root moves down a level
+    if (runs > room){
+        uint64_t needed = (uint64_t)(depth + 2) * (1 + runs / EXTENTS_FOR(BLOCK_SIZE));
+        if (needed > bfs_free_blocks()){
+            return -2;
+        }
+    }
+    
+    if (convert){
+        inode_block->contents.inode.flags |= INODE_FLAG_EXTENTS;
+        memset(root, 0, sizeof(struct extent_header) + EXTENTS_FOR(BLOCK_SIZE) * sizeof(struct extent));
+        if (extent_append_list(inode_block, 0, old_block_nums, cur_block_amount, undo) == -1){
+            return -1;
+        }
+    } else if (extent_save_path(root, inode_block->contents.inode.extents, undo) == -1){
+        return -1;
+    }
+    return extent_append_list(inode_block, cur_block_amount, new_block_nums, count, undo);
+}
+
+
+// how many bytes of data an inode of the mounted disk can keep in itself
+// (none on disks with 16-bit block numbers)
+static size_t inline_capacity() {
+    return wide_block_nums ? BLOCK_SIZE - NODE_HEADER_SIZE : 0;
+}
+
+// how many data blocks a file has (a file kept in its inode has none)
+static uint32_t file_data_blocks(const struct block* inode_block) {
+    if (inode_block->contents.inode.flags & INODE_FLAG_INLINE){
+        return 0;
+    }
+    return (inode_block->contents.inode.file_size + BLOCK_SIZE - 1)/BLOCK_SIZE; // ceiling division
+}
+
+/* release_data_blocks
+ *   helper function to release all the data block from the given inode
+ *
+ * returns 0 on success, otherwise returns -1 
+ */
+static int release_data_blocks(struct block* inode_block){
+    // store file size
+    uint32_t fSize = (*inode_block).contents.inode.file_size;
+    
+    if ((*inode_block).contents.inode.flags & INODE_FLAG_INLINE){
+        // nothing outside the inode
+        return 0;
+    }
+    if ((*inode_block).contents.inode.flags & INODE_FLAG_EXTENTS){
+        // release every extent, and the tree blocks holding them
+        return extent_release(&(*inode_block).contents.inode.extent_header,
+                              (*inode_block).contents.inode.extents);
+    }
+    
+    // get data block amount
+    int block_amount = (fSize + BLOCK_SIZE - 1)/BLOCK_SIZE; // ceiling division
+    
+    // release all the datablocks
+    return release_blocks((*inode_block).contents.inode.data_blocks, block_amount);
+}
+
+/* write_data_blocks
+ *   helper function to write the data from buf to the end of the data blocks
+ *   associated with the inode block provided. In this process, data blocks would 
+ *   be updated or created. And the inode block would also be updated accordingly.
+ *   New blocks that buf fills completely are written straight from it; only
+ *   the partly filled last block of the file and the new last block are
+ *   staged. Either all of the data is appended or none of it is.
+ *
+ * inode_block: representing a file
+ * buf: where data coming from, or NULL to append zeros
+ * count: how many bytes to get copy from buf
+ *
+ * returns 0 on success, -2 for disk full (allocate fail), otherwise returns -1 
+ */
+static int write_data_blocks(struct block* inode_block, const void* buf, size_t count){
+    static const char zero_block[MAX_BLOCK_SIZE];
+    const char* buf_ptr = (const char*)buf;
+    
+    uint32_t cur_fSize = (*inode_block).contents.inode.file_size;
+    uint32_t cur_block_amount = 
+        (cur_fSize + BLOCK_SIZE - 1)/BLOCK_SIZE; // ceiling division
+    
+    // the bytes still free in the last data block
+    size_t room = (size_t)cur_block_amount * BLOCK_SIZE - cur_fSize;
+    size_t head = (room < count) ? room : count;
+    
+    uint32_t new_size = cur_fSize + count;
+    uint32_t new_block_amount = 
+        (new_size + BLOCK_SIZE - 1)/BLOCK_SIZE; // ceiling division
+        
+    // block amount that need to be added
+    uint32_t block_amount_diff = new_block_amount - cur_block_amount;
+    
+    // the last block and every new block go out in one batched write
+    block_num_t* write_nums = malloc((block_amount_diff + 1) * sizeof(block_num_t));
+    const void** write_bufs = malloc((block_amount_diff + 1) * sizeof(void*));
+    if (write_nums == NULL || write_bufs == NULL){
+        free(write_nums);
+        free(write_bufs);
+        return -1;
+    }
+    uint32_t write_counter = 0;
+    
+    // append to the last data block if it is not full
+    struct block last_block;
+    if (head > 0){
+        block_num_t last_block_num;
+        if (file_block_nums(inode_block, cur_block_amount - 1, 1, &last_block_num) == -1 ||
+            cache_read_block(last_block_num, &last_block) == -1){
+            free(write_nums);
+            free(write_bufs);
+            return -1;
+        }
+        char* last_ptr = (char*)(&last_block);
+        if (buf_ptr == NULL){
+            memset(&last_ptr[BLOCK_SIZE - room], 0, head);
+        } else {
+            memcpy(&last_ptr[BLOCK_SIZE - room], buf_ptr, head);
+        }
+        write_nums[write_counter] = last_block_num;
+        write_bufs[write_counter++] = &last_block;
+    }
+    
+    // allocate all needed data blocks, in as few contiguous runs as
+    // possible so the file can be read back with few requests
+    block_num_t* new_block_nums = &write_nums[write_counter];
+    if (allocate_blocks(block_amount_diff, new_block_nums) != 0){
+        free(write_nums);
+        free(write_bufs);
+        return -2;
+    }
+    
+    // point at the data of the new blocks; a partly filled last one is
+    // padded with zeros
+    struct block tail_block;
+    size_t copied = head;
+    for (uint32_t i = 0; i < block_amount_diff; i++){
+        size_t left = count - copied;
+        if (buf_ptr == NULL){
+            write_bufs[write_counter++] = zero_block;
+        } else if (left >= BLOCK_SIZE){
+            write_bufs[write_counter++] = &buf_ptr[copied];
+        } else {
+            memcpy(&tail_block, &buf_ptr[copied], left);
+            memset((char*)(&tail_block) + left, 0, BLOCK_SIZE - left);
+            write_bufs[write_counter++] = &tail_block;
+        }
+        copied += BLOCK_SIZE;
+    }
+    
+    // update inode block (keeping what it was, to go back to on failure)
+    struct block saved_inode = *inode_block;
+    struct extent_undo undo = {0};
+    int ret_temp = add_file_blocks(inode_block, cur_block_amount, new_block_nums,
+                                   block_amount_diff, &undo);
+    if (ret_temp == 0){
+        (*inode_block).contents.inode.file_size = new_size;
+        
+        // write the last block and all new blocks
+        ret_temp = cache_write_blocks(write_nums, write_bufs, write_counter);
+    }
+    if (ret_temp != 0){
+        // leave the file and its extent tree as they were
+        extent_undo(&undo);
+        *inode_block = saved_inode;
+        release_blocks(new_block_nums, block_amount_diff);
+    }
+    extent_undo_free(&undo);
+    free(write_nums);
+    free(write_bufs);
+    return ret_temp;
+}
+
+
+// bytes write_file_range() hands write_data_blocks() at a time, which bounds
+// the block number lists it allocates
+#define WRITE_CHUNK_SIZE (1 << 20)
+
+// One entry of the open-file table (a free entry has in_use == FALSE).  The
+// name is resolved once, by jfs_open(); after that the handle holds what
+// every access needs, so jfs_hread() and jfs_hwrite() go straight to the
+// data.  Writes through any handle, or by name, keep the inode copies of all
+// handles open on the same file up to date.  An append stream (opened by
+// jfs_append_open()) holds back its inode and partly filled last block
+// instead; anything else that looks at the file writes them first.
+struct file_handle {
+    bool_t in_use;
+    bool_t removed;              // the file was removed while open
+    bool_t is_stream;            // opened by jfs_append_open()
+    bool_t dirty;                // the stream's inode and tail are ahead of the disk
+    block_num_t inode_block_num;
+    struct block inode;
+    uint64_t offset;             // where the next jfs_hread() / jfs_hwrite() starts
+    bool_t tail_valid;           // whether tail holds the file's partly filled last data block
+    block_num_t tail_block_num;
+    char tail[MAX_BLOCK_SIZE];
+};
+
+static struct file_handle handles[MAX_OPEN_FILES];
+
+// jfs_hread() and jfs_hseek() only share fs_lock, so they move a handle's
+// offset under that handle's lock (everything that holds fs_lock alone can
+// use the offset without it); jfs_mount() sets the locks up the first time
+static pthread_mutex_t offset_locks[MAX_OPEN_FILES];
+static pthread_once_t offset_locks_once = PTHREAD_ONCE_INIT;
+
+static void init_offset_locks() {
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        pthread_mutex_init(&offset_locks[i], NULL);
+    }
+}
+
+// whether any append stream is open
+static bool_t streams_open() {
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        if (handles[i].in_use && handles[i].is_stream){
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// after a write through file, hands its inode to the other handles open on
+// the same file (their copies of the last block may be stale now)
+static void file_changed(const struct file_handle* file) {
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        struct file_handle* other = &handles[i];
+        if (other != file && other->in_use && !other->removed &&
+            other->inode_block_num == file->inode_block_num){
+            other->inode = file->inode;
+            other->tail_valid = FALSE;
+        }
+    }
+}
+
+/* flush_stream
+ *   helper function to write what an append stream holds back: its partly
+ *   filled last data block and its inode
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int flush_stream(struct file_handle* file) {
+    if (!file->dirty){
+        return 0;
+    }
+    file->dirty = FALSE;
+    if (file->removed){
+        // the blocks aren't the file's any more
+        return 0;
+    }
+    if ((file->tail_valid && cache_write_block(file->tail_block_num, file->tail) == -1) ||
+        write_node(file->inode_block_num, &file->inode) == -1){
+        return -1;
+    }
+    file_changed(file);
+    return 0;
+}
+
+/* flush_streams
+ *   helper function to flush every append stream open on the file whose
+ *   inode is in inode_block_num (or on any file, if it is 0), except skip
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int flush_streams(block_num_t inode_block_num, const struct file_handle* skip) {
+    int ret = 0;
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        struct file_handle* stream = &handles[i];
+        if (stream != skip && stream->in_use && stream->is_stream &&
+            (inode_block_num == 0 || stream->inode_block_num == inode_block_num) &&
+            flush_stream(stream) == -1){
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/* open_file
+ *   helper function to find a regular file and fill in a handle for it,
+ *   positioned at the start of the file
+ *
+ * returns 0 on success, otherwise E_NOT_EXISTS, E_NOT_DIR, E_IS_DIR or
+ *   E_UNKNOWN
+ */
+static int open_file(const char* file_name, struct file_handle* file) {
+    // check if the path leads anywhere
+    struct path_target path;
+    struct dentry target;
+    int ret = find_path(file_name, &path, &target);
+    if (ret != E_SUCCESS){
+        return ret;
+    }
+    // check if target is a file
+    if (target.is_dir){
+        return E_IS_DIR;
+    }
+    if (flush_streams(target.child, NULL) == -1 ||
+        read_node(target.child, &file->inode) == -1){
+        return E_UNKNOWN;
+    }
+    file->in_use = TRUE;
+    file->removed = FALSE;
+    file->is_stream = FALSE;
+    file->dirty = FALSE;
+    file->inode_block_num = target.child;
+    file->offset = 0;
+    file->tail_valid = FALSE;
+    return E_SUCCESS;
 }
 
-/* if_exist
- *   helper function to see if a "name" exists 
- *   in a given block ("block_num")
+// the part of a file's byte range [offset, offset + count) that falls in
+// its data block block_index, as positions in the file
+static void block_overlap(uint32_t block_index, size_t count, uint64_t offset,
+                          uint64_t* lo, uint64_t* hi) {
+    uint64_t block_start = (uint64_t)block_index * BLOCK_SIZE;
+    *lo = (block_start > offset) ? block_start : offset;
+    *hi = (block_start + BLOCK_SIZE < offset + count) ? block_start + BLOCK_SIZE : offset + count;
+}
+
+/* read_file_range
+ *   helper function to copy count bytes of a file, from byte offset on, into
+ *   buf, touching only the data blocks that overlap them.  Blocks that are
+ *   cached (or on a mapped disk) are copied from there; the rest are read
+ *   with one batched call, whole blocks straight into buf, so only partly
+ *   wanted blocks at either end go through a bounce buffer.
+ *   (precondition: the bytes are all inside the file)
  *
- * name: the name of a dir or file
- * 
- * returns -1 if not exist or error, otherwise the index of the file/dir 
- * in the "entries" (see the "struct block" in jumbo_file_system.h )
- */ 
-static int if_exist(const char* target_name) {
-    // get current folder block in current_dir
-    struct block cur_block;
-    bzero(&cur_block, sizeof(struct block));
-    int ret_temp = read_block(current_dir, &cur_block);
-    if (ret_temp == -1){
-        return ret_temp;
+ * returns 0 on success, otherwise returns -1
+ */
+static int read_file_range(const struct block* inode_block, void* buf, size_t count, uint64_t offset) {
+    if (count == 0){
+        return 0;
     }
-    
-    // get current number of entries in the current folder
-    uint16_t cur_entries = cur_block.contents.dirnode.num_entries;
-    // check if name exits
-    for (int i = 0; i < cur_entries; i++){
-        if (strcmp(cur_block.contents.dirnode.entries[i].name, target_name)== 0){
-            return i;
+    if (inode_block->contents.inode.flags & INODE_FLAG_INLINE){
+        memcpy(buf, &inode_block->contents.inode.data[offset], count);
+        return 0;
+    }
+    uint32_t first = offset / BLOCK_SIZE;
+    uint32_t block_amount = (offset + count - 1) / BLOCK_SIZE - first + 1;
+    block_num_t* data_block_nums = malloc(block_amount * sizeof(block_num_t));
+    void** miss_bufs = malloc(block_amount * sizeof(void*));
+    char edges[2][MAX_BLOCK_SIZE];
+    uint32_t edge_index[2];
+    int num_edges = 0;
+    int ret = -1;
+    if (data_block_nums != NULL && miss_bufs != NULL &&
+        file_block_nums(inode_block, first, block_amount, data_block_nums) == 0){
+        // misses are packed to the front of data_block_nums as they are found
+        uint32_t misses = 0;
+        for (uint32_t i = 0; i < block_amount; i++){
+            uint64_t lo, hi;
+            block_overlap(first + i, count, offset, &lo, &hi);
+            const void* data_block = cache_peek_block(data_block_nums[i]);
+            if (data_block != NULL){
+                memcpy((char*)buf + (lo - offset), (const char*)data_block + lo % BLOCK_SIZE, hi - lo);
+                continue;
+            }
+            data_block_nums[misses] = data_block_nums[i];
+            if (hi - lo == BLOCK_SIZE){
+                miss_bufs[misses++] = (char*)buf + (lo - offset);
+            } else {
+                // only the first and last blocks can be partly wanted
+                edge_index[num_edges] = first + i;
+                miss_bufs[misses++] = edges[num_edges++];
+            }
         }
+        ret = (misses == 0) ? 0 : cache_read_blocks(data_block_nums, miss_bufs, misses);
     }
-    return -1;
+    for (int i = 0; i < num_edges && ret == 0; i++){
+        uint64_t lo, hi;
+        block_overlap(edge_index[i], count, offset, &lo, &hi);
+        memcpy((char*)buf + (lo - offset), &edges[i][lo % BLOCK_SIZE], hi - lo);
+    }
+    free(data_block_nums);
+    free(miss_bufs);
+    return ret;
 }
-/* remove_directory_entry
- *   helper function to remove the specific entry from the given block (folder):
- *   release the deleted block, update the meta data of the given block (folder)
- * cur_block: the block to remove the entry
- * entry_index: index of the entry in the block
+
+/* overwrite_file_range
+ *   helper function to overwrite count bytes of a file, from byte offset on,
+ *   with buf.  Whole blocks are written straight from buf; only partly
+ *   covered blocks at either end are read, patched and written back.
+ *   (precondition: the bytes are all inside the file)
  *
- * returns 0 on failure, otherwise returns the block num of the inode or dir block
- *   of the deleted entry
+ * returns 0 on success, otherwise returns -1
  */
-static block_num_t remove_directory_entry(struct block* cur_block, int entry_index){
-    
-    // release the target block (to be deleted)
-    block_num_t target_block_num = 
-        (*cur_block).contents.dirnode.entries[entry_index].block_num;
-    int ret_temp = release_block(target_block_num);
-    if (ret_temp == -1){
-        //release failed
+static int overwrite_file_range(const struct block* inode_block, const void* buf,
+                                size_t count, uint64_t offset) {
+    if (count == 0){
         return 0;
     }
-    
-    // clean up the target block
-    // by write a new empty block back
-    struct block new_block;
-    bzero(&new_block, sizeof(struct block));
-    write_block(target_block_num, &new_block); 
-    
-    //	Remove entry from cur_block
-    uint16_t cur_entry_num = (*cur_block).contents.dirnode.num_entries;
-    if (entry_index+1 != cur_entry_num){
-        // target entry is not the last entry
-        // replace the target entry with the last entry
-        (*cur_block).contents.dirnode.entries[entry_index].block_num = 
-            (*cur_block).contents.dirnode.entries[cur_entry_num-1].block_num;
-        strcpy((*cur_block).contents.dirnode.entries[entry_index].name,
-           (*cur_block).contents.dirnode.entries[cur_entry_num-1].name);
-    }
-    // decrease the entry number by one
-    (*cur_block).contents.dirnode.num_entries--;
-    // write back the current block
-    if (write_block(current_dir, (void *)cur_block) == -1){
-        return 0;
+    uint32_t first = offset / BLOCK_SIZE;
+    uint32_t block_amount = (offset + count - 1) / BLOCK_SIZE - first + 1;
+    block_num_t* data_block_nums = malloc(block_amount * sizeof(block_num_t));
+    const void** write_bufs = malloc(block_amount * sizeof(void*));
+    char edges[2][MAX_BLOCK_SIZE];
+    int num_edges = 0;
+    int ret = -1;
+    if (data_block_nums != NULL && write_bufs != NULL &&
+        file_block_nums(inode_block, first, block_amount, data_block_nums) == 0){
+        ret = 0;
+        for (uint32_t i = 0; i < block_amount && ret == 0; i++){
+            uint64_t lo, hi;
+            block_overlap(first + i, count, offset, &lo, &hi);
+            if (hi - lo == BLOCK_SIZE){
+                write_bufs[i] = (const char*)buf + (lo - offset);
+                continue;
+            }
+            // only the first and last blocks can be partly covered
+            char* edge = edges[num_edges++];
+            ret = cache_read_block(data_block_nums[i], edge);
+            memcpy(&edge[lo % BLOCK_SIZE], (const char*)buf + (lo - offset), hi - lo);
+            write_bufs[i] = edge;
+        }
     }
-    
-    
-    return target_block_num;
+    if (ret == 0){
+        ret = cache_write_blocks(data_block_nums, write_bufs, block_amount);
+    }
+    free(data_block_nums);
+    free(write_bufs);
+    return ret;
 }
 
-/* release_data_blocks
- *   helper function to release all the data block from the given inode
+/* write_inline
+ *   helper function for write_file_range(): writes into a file kept in its
+ *   inode, with zeros up to offset if it starts past the end
+ *   (precondition: offset + count is at most inline_capacity())
  *
- * returns 0 on success, otherwise returns -1 
+ * returns 0 on success, otherwise E_UNKNOWN
  */
-static int release_data_blocks(struct block* inode_block){
-    // store file size
-    uint32_t fSize = (*inode_block).contents.inode.file_size;
-    
-    // get data block amount
-    int block_amount = (fSize + BLOCK_SIZE - 1)/BLOCK_SIZE; // ceiling division
-    
-    // release all the datablocks
-    for (int i = 0; i < block_amount; i++){
-        block_num_t data_block_num = (*inode_block).contents.inode.data_blocks[i];
-        int ret_temp = release_block(data_block_num);
-        if (ret_temp == -1){
-            //release failed
-            return -1;
-        }    
+static int write_inline(block_num_t inode_block_num, struct block* inode_block,
+                        const void* buf, size_t count, uint64_t offset) {
+    uint32_t fSize = inode_block->contents.inode.file_size;
+    char* data = inode_block->contents.inode.data;
+    if (count == 0){
+        return E_SUCCESS;
     }
-    return 0;
-    
+    if (offset > fSize){
+        memset(&data[fSize], 0, offset - fSize);
+    }
+    memcpy(&data[offset], buf, count);
+    if (offset + count > fSize){
+        inode_block->contents.inode.file_size = offset + count;
+    }
+    if (write_node(inode_block_num, inode_block) == -1){
+        return E_UNKNOWN;
+    }
+    return E_SUCCESS;
+}
+
+/* move_out_of_inode
+ *   helper function for write_file_range(): moves the bytes of a file kept
+ *   in its inode out to data blocks, ahead of it outgrowing the inode (the
+ *   inode is only changed in memory)
+ *
+ * returns 0 on success, -2 for disk full (allocate fail), otherwise returns
+ *   -1; the file is still kept in its inode on failure
+ */
+static int move_out_of_inode(struct block* inode_block) {
+    uint32_t fSize = inode_block->contents.inode.file_size;
+    uint16_t flags = inode_block->contents.inode.flags;
+    char data[MAX_BLOCK_SIZE - NODE_HEADER_SIZE];
+    memcpy(data, inode_block->contents.inode.data, fSize);
+    
+    // an empty extent tree, then the bytes appended to it
+    inode_block->contents.inode.flags = INODE_FLAG_EXTENTS;
+    inode_block->contents.inode.file_size = 0;
+    memset(&inode_block->contents.inode.extent_header, 0, sizeof(struct extent_header));
+    memset(inode_block->contents.inode.data, 0, inline_capacity());
+    int ret = write_data_blocks(inode_block, data, fSize);
+    if (ret != 0){
+        inode_block->contents.inode.flags = flags;
+        inode_block->contents.inode.file_size = fSize;
+        memset(&inode_block->contents.inode.extent_header, 0, sizeof(struct extent_header));
+        memset(inode_block->contents.inode.data, 0, inline_capacity());
+        memcpy(inode_block->contents.inode.data, data, fSize);
+    }
+    return ret;
 }
 
-/* release_all
- *   helper function to release all blocks in the block_num_list
- * returns 0 for success, -1 otherwise
+/* part_cost
+ *   helper function for write_file_range(): the most blocks that one part
+ *   of a write, of bytes at byte pos, puts in the transaction (see
+ *   bfs_room()).  Data blocks only count if they are written through the
+ *   cache; a bigger batch goes straight home (see cache_bulk_limit()).  An
+ *   append also changes the inode and the extent tree: at worst every level
+ *   of the last path fills up once per leaf of new extents and the root
+ *   moves down a level, and a file that lists its blocks directly moves
+ *   them all to the tree.
+ * pos: for an append, the file's size
  */
-static int release_all(block_num_t* block_num_list, int list_size){
-    int result = 0;
-    for (int i =0; i < list_size; i++){
-        if (release_block(block_num_list[i]) != 0){
-            result = -1;
+static uint32_t part_cost(const struct block* inode_block, uint64_t pos, uint64_t bytes,
+                          bool_t appending) {
+    uint64_t batch = 0;
+    uint64_t new_blocks = 0;
+    if (bytes > 0 && !appending){
+        batch = (pos + bytes - 1) / BLOCK_SIZE - pos / BLOCK_SIZE + 1;
+    } else if (bytes > 0){
+        // the partly filled last block and the new ones (see write_data_blocks())
+        uint64_t cur_blocks = (pos + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        new_blocks = (pos + bytes + BLOCK_SIZE - 1) / BLOCK_SIZE - cur_blocks;
+        batch = new_blocks + (cur_blocks * BLOCK_SIZE > pos);
+    }
+    uint64_t cost = (batch > cache_bulk_limit()) ? 0 : batch;
+    if (appending){
+        uint64_t tree = 0;
+        if (wide_block_nums){
+            bool_t extents = (inode_block->contents.inode.flags & INODE_FLAG_EXTENTS) != 0;
+            uint32_t depth = extents ? inode_block->contents.inode.extent_header.depth : 0;
+            uint64_t runs = new_blocks + (extents ? 0 : file_data_blocks(inode_block));
+            tree = (uint64_t)(depth + 2) * (1 + runs / EXTENTS_FOR(BLOCK_SIZE)) + depth;
         }
+        cost += 1 + tree;
     }
-    return result;
+    return (cost < UINT32_MAX) ? cost : UINT32_MAX;
 }
 
-/* write_data_blocks
- *   helper function to write the data from buf to the end of the data blocks
- *   associated with the inode block provided. In this process, data blocks would 
- *   be updated or created. And the inode block would also be updated accordingly.
+/* begin_part
+ *   helper function for write_file_range(): starts the next part of a
+ *   write, of *bytes at byte pos (see part_cost()).  The inode is written
+ *   first if the parts so far changed it, so the file is consistent
+ *   wherever the transaction gets committed; then room is made for the part
+ *   (see bfs_reserve()).
+ * inode_dirty: whether the inode has changes that aren't written yet
+ * bytes: cut down (to end on a block boundary, where it can) until the part
+ *   fits in the transaction
  *
- * inode_block: representing a file
- * buf: where data coming from
- * count: how many bytes to get copy from buf
+ * returns 0 on success, otherwise returns -1 (also if not even one byte fits)
+ */
+static int begin_part(block_num_t inode_block_num, const struct block* inode_block,
+                      bool_t* inode_dirty, bool_t appending, uint64_t pos, uint64_t* bytes) {
+    if (*inode_dirty){
+        if (write_node(inode_block_num, inode_block) == -1){
+            return -1;
+        }
+        *inode_dirty = FALSE;
+    }
+    uint32_t cost = part_cost(inode_block, pos, *bytes, appending);
+    if (bfs_reserve(cost, appending ? cost + *bytes / BLOCK_SIZE + 1 : 0) == -1){
+        return -1;
+    }
+    while (*bytes > 1 && part_cost(inode_block, pos, *bytes, appending) > bfs_room()){
+        uint64_t half = *bytes / 2;
+        if (half > BLOCK_SIZE){
+            half -= (pos + half) % BLOCK_SIZE;
+        }
+        *bytes = half;
+    }
+    return (part_cost(inode_block, pos, *bytes, appending) <= bfs_room()) ? 0 : -1;
+}
+
+/* write_file_range
+ *   helper function to write count bytes from buf into a file at byte
+ *   offset: the part inside the file is overwritten, the file is grown with
+ *   zeros if offset is past its end, and the rest is appended.  A big write
+ *   goes in parts that each fit in what is left of the transaction, and the
+ *   file is consistent between them.
+ * inode_block_num / inode_block: the file's inode, which is written back
+ *   if the file grew
  *
- * returns 0 on success, -2 for disk full (allocate fail), otherwise returns -1 
+ * returns 0 on success or E_MAX_FILE_SIZE, E_DISK_FULL or E_UNKNOWN; after
+ *   an E_DISK_FULL part of the data may have been written
  */
-static int write_data_blocks(struct block* inode_block, const void* buf, unsigned short count){
-    // record the next index of buf to be copied
-    int copied = 0;
-    
-    uint32_t cur_fSize = (*inode_block).contents.inode.file_size;
-    int cur_block_amount = 
-        (cur_fSize + BLOCK_SIZE - 1)/BLOCK_SIZE; // ceiling division
-        
-    // the bytes that all current data blocks can hold
-    uint32_t cur_block_vol = cur_block_amount * BLOCK_SIZE;
-    
-    uint32_t new_size = cur_fSize + count;
-    int new_block_amount = 
-        (new_size + BLOCK_SIZE - 1)/BLOCK_SIZE; // ceiling division
-        
-    // block amount that need to be added
-    int block_amount_diff = new_block_amount - cur_block_amount;
-    
-    // data structure to store new data blocks and their block_num
-    struct block new_blocks[block_amount_diff];
-    bzero(new_blocks, sizeof(new_blocks));
-    int new_blocks_counter = 0;
+static int write_file_range(block_num_t inode_block_num, struct block* inode_block,
+                            const void* buf, size_t count, uint64_t offset) {
+    // check max file size error (before offset + count, which could wrap)
+    uint32_t cur_fSize = inode_block->contents.inode.file_size;
+    if (offset > MAX_FILE_SIZE || count > MAX_FILE_SIZE - offset){
+        return E_MAX_FILE_SIZE;
+    }
+    uint64_t end = offset + count;
+    if (count == 0){
+        // writing nothing doesn't grow the file, even past its end
+        return E_SUCCESS;
+    }
     
-    block_num_t new_block_nums[block_amount_diff];
-    bzero(new_block_nums, sizeof(new_block_nums));
-    int new_block_nums_counter = 0;
+    // a file that fits stays in (or, while empty, moves into) its inode
+    uint64_t new_size = (end > cur_fSize) ? end : cur_fSize;
+    if (cur_fSize == 0 && inline_capacity() > 0){
+        inode_block->contents.inode.flags |= INODE_FLAG_INLINE;
+    }
+    bool_t in_inode = (inode_block->contents.inode.flags & INODE_FLAG_INLINE) != 0;
+    if (in_inode && new_size <= inline_capacity()){
+        return write_inline(inode_block_num, inode_block, buf, count, offset);
+    }
     
-    // create a new block for the last data block in the current inode
-    struct block last_block;
-    bzero(&last_block, sizeof(struct block));
+    // check disk full error before anything is allocated or written (once
+    // the blocks released since the last commit are free again)
+    uint32_t new_blocks_needed = (new_size + BLOCK_SIZE - 1)/BLOCK_SIZE -
+        file_data_blocks(inode_block); // ceiling division
+    if (bfs_reserve(0, new_blocks_needed) == -1){
+        return E_UNKNOWN;
+    }
+    if (new_blocks_needed > bfs_free_blocks()){
+        return E_DISK_FULL;
+    }
     
-    // get the block_num for the last data block
-    block_num_t last_block_num = 
-            (*inode_block).contents.inode.data_blocks[cur_block_amount - 1];
+    // the file outgrows its inode (a part of its own)
+    bool_t inode_dirty = FALSE;
+    if (in_inode){
+        uint64_t bytes = cur_fSize;
+        if (begin_part(inode_block_num, inode_block, &inode_dirty, TRUE, 0, &bytes) == -1 ||
+            bytes != cur_fSize){
+            return E_UNKNOWN;
+        }
+        int move_result = move_out_of_inode(inode_block);
+        if (move_result == -2){
+            return E_DISK_FULL;
+        } else if (move_result != 0){
+            return E_UNKNOWN;
+        }
+        inode_dirty = TRUE;
+    }
     
-    // allocate all needed data blocks
-    for (int i = 0; i < block_amount_diff; i++){
-        block_num_t new_block_num = allocate_block();        
-        if (new_block_num == 0){
-            release_all(new_block_nums, new_block_nums_counter);
-            return -2;
+    // overwrite the part that is already in the file
+    const char* buf_ptr = (const char*)buf;
+    size_t inside = 0;
+    if (offset < cur_fSize){
+        inside = (cur_fSize - offset < count) ? cur_fSize - offset : count;
+    }
+    for (size_t done = 0; done < inside; ){
+        uint64_t pos = offset + done;
+        uint64_t chunk = (inside - done < WRITE_CHUNK_SIZE) ? inside - done : WRITE_CHUNK_SIZE;
+        if (begin_part(inode_block_num, inode_block, &inode_dirty, FALSE, pos, &chunk) == -1){
+            return E_UNKNOWN;
+        }
+        if (overwrite_file_range(inode_block, &buf_ptr[done], chunk, pos) == -1){
+            return E_UNKNOWN;
         }
-        new_block_nums[new_block_nums_counter++] = new_block_num;
+        done += chunk;
     }
     
-    // create data blocks
-    if (cur_fSize < cur_block_vol){
-        // last data block is not full
-        // get the last data block        
-        int ret_temp = read_block(last_block_num, &last_block);
-        if (ret_temp == -1){
-            return ret_temp;
+    // append the rest, after zeros up to offset if it starts past the end
+    int write_result = 0;
+    size_t done = inside;
+    while (write_result == 0 && (inode_block->contents.inode.file_size < offset || done < count)){
+        bool_t gap = inode_block->contents.inode.file_size < offset;
+        uint64_t chunk = gap ? offset - inode_block->contents.inode.file_size : count - done;
+        if (chunk > WRITE_CHUNK_SIZE){
+            chunk = WRITE_CHUNK_SIZE;
         }
-        
-        // calculate the start point to write new data in the last block
-        //start index (zero based)        
-        int from_here = BLOCK_SIZE - (cur_block_vol - cur_fSize);
-        int bytes_left = cur_block_vol - cur_fSize;
-            
-        // append data to the last block
-        char* last_ptr = (char*)(&last_block);
-        char* buf_ptr = (char*)buf;
-        if (bytes_left > count){
-            memcpy(&(last_ptr[from_here]), &(buf_ptr[copied]), count);
-            copied = copied + count;
-            count = 0;
-        } else {
-            memcpy(&(last_ptr[from_here]), &(buf_ptr[copied]), bytes_left);
-            copied = copied + bytes_left;
-            count = count - bytes_left;
-        }
-    }
-    // fill in new data blocks
-    for (int i = 0; i < block_amount_diff; i++){
-        char* buf_ptr = (char*)buf;
-        if (count <= BLOCK_SIZE){
-            memcpy(&(new_blocks[new_blocks_counter++]), &(buf_ptr[copied]), count);
-            copied = copied + count;
-            count = 0;
-        } else{
-            memcpy(&(new_blocks[new_blocks_counter++]), &(buf_ptr[copied]), BLOCK_SIZE);
-            copied = copied + BLOCK_SIZE;
-            count = count - BLOCK_SIZE;
-        }          
-    }
-    
-    // update inode block
-    (*inode_block).contents.inode.file_size = new_size;
-    for (int i =0; i < new_block_nums_counter; i++){
-        (*inode_block).contents.inode.data_blocks[cur_block_amount + i] = 
-            new_block_nums[i];
-    }
-    
-    // write data blocks
-    if (cur_fSize < cur_block_vol){
-        // no new data block
-        // write the last block
-        int ret_temp = write_block(last_block_num, (void *)&last_block);
-        if (ret_temp == -1){
-            release_all(new_block_nums, new_block_nums_counter);
-            return -1;
+        if (begin_part(inode_block_num, inode_block, &inode_dirty, TRUE,
+                       inode_block->contents.inode.file_size, &chunk) == -1){
+            write_result = -1;
+            break;
+        }
+        write_result = write_data_blocks(inode_block, gap ? NULL : &buf_ptr[done], chunk);
+        if (write_result == 0){
+            inode_dirty = TRUE;
+            if (!gap){
+                done += chunk;
+            }
         }
     }
     
-    // write new blocks
-    for (int i = 0; i < block_amount_diff; i++){
-        int ret_temp = write_block(new_block_nums[i], (void *)&(new_blocks[i]));
-        if (ret_temp == -1){
-            release_all(new_block_nums, new_block_nums_counter);
+    // write the inode to disk, even if only part was appended
+    if (inode_dirty && write_node(inode_block_num, inode_block) == -1){
+        return E_UNKNOWN;
+    }
+    if (write_result == -2){
+        // full error
+        return E_DISK_FULL;
+    } else if (write_result != 0){
+        return E_UNKNOWN;
+    }
+    return E_SUCCESS;
+}
+
+
+/* read_file
+ *   helper function to copy up to *ptr_count bytes of an open file, from
+ *   byte offset on, into buf; *ptr_count is trimmed to what the file holds
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int read_file(const struct file_handle* file, void* buf, size_t* ptr_count, uint64_t offset) {
+    uint32_t fSize = file->inode.contents.inode.file_size;
+    if (offset >= fSize){
+        *ptr_count = 0;
+    } else if (*ptr_count > fSize - offset){
+        *ptr_count = fSize - offset;
+    }
+    return read_file_range(&file->inode, buf, *ptr_count, offset);
+}
+
+// loads the partly filled last data block of an open file into its handle,
+// unless it is there already; returns 0 on success, otherwise -1
+static int load_tail(struct file_handle* file) {
+    if (!file->tail_valid){
+        uint32_t fSize = file->inode.contents.inode.file_size;
+        if (file_block_nums(&file->inode, fSize / BLOCK_SIZE, 1, &file->tail_block_num) == -1 ||
+            cache_read_block(file->tail_block_num, file->tail) == -1){
+            return -1;
+        }
+        file->tail_valid = TRUE;
+    }
+    return 0;
+}
+
+/* append_to_tail
+ *   helper function for write_file(): appends bytes that fit in the room
+ *   left in the file's last data block.  The block stays in the handle, so
+ *   a run of small appends costs one data block write (plus the inode) each.
+ *   (precondition: the file doesn't end on a block boundary and the bytes
+ *   fit in the rest of its last block)
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int append_to_tail(struct file_handle* file, const void* buf, size_t count) {
+    uint32_t fSize = file->inode.contents.inode.file_size;
+    if (load_tail(file) == -1){
+        return -1;
+    }
+    memcpy(&file->tail[fSize % BLOCK_SIZE], buf, count);
+    if (cache_write_block(file->tail_block_num, file->tail) == -1){
+        return -1;
+    }
+    file->inode.contents.inode.file_size = fSize + count;
+    return write_node(file->inode_block_num, &file->inode);
+}
+
+/* write_file
+ *   helper function to write count bytes from buf into an open file at byte
+ *   offset (see write_file_range())
+ *
+ * returns 0 on success or E_MAX_FILE_SIZE, E_DISK_FULL or E_UNKNOWN
+ */
+static int write_file(struct file_handle* file, const void* buf, size_t count, uint64_t offset) {
+    uint32_t fSize = file->inode.contents.inode.file_size;
+    uint32_t room = (BLOCK_SIZE - fSize % BLOCK_SIZE) % BLOCK_SIZE;
+    int ret;
+    if (offset == fSize && count > 0 && count <= room &&
+        !(file->inode.contents.inode.flags & INODE_FLAG_INLINE)){
+        ret = (append_to_tail(file, buf, count) == 0) ? E_SUCCESS : E_UNKNOWN;
+    } else {
+        file->tail_valid = FALSE;
+        ret = write_file_range(file->inode_block_num, &file->inode, buf, count, offset);
+    }
+    if (ret != E_SUCCESS){
+        // the copy in the handle may be ahead of the inode on the disk
+        file->tail_valid = FALSE;
+        if (read_node(file->inode_block_num, &file->inode) == -1){
+            ret = E_UNKNOWN;
+        }
+    }
+    file_changed(file);
+    return ret;
+}
+
+/* append_to_stream
+ *   helper function for jfs_append(): appends count bytes to the file of an
+ *   append stream.  Bytes that fit in the inode (for a file kept there) or
+ *   in the room left in the last data block are only copied into the
+ *   handle, and that block is written once it fills; anything bigger is
+ *   written through write_file() after flushing the stream.
+ *
+ * returns 0 on success or E_MAX_FILE_SIZE, E_DISK_FULL or E_UNKNOWN
+ */
+static int append_to_stream(struct file_handle* file, const void* buf, size_t count) {
+    uint32_t fSize = file->inode.contents.inode.file_size;
+    uint32_t room = (BLOCK_SIZE - fSize % BLOCK_SIZE) % BLOCK_SIZE;
+    if (count == 0){
+        return E_SUCCESS;
+    }
+    if (file->inode.contents.inode.flags & INODE_FLAG_INLINE){
+        if (count <= inline_capacity() - fSize){
+            memcpy(&file->inode.contents.inode.data[fSize], buf, count);
+            file->inode.contents.inode.file_size = fSize + count;
+            file->dirty = TRUE;
+            return E_SUCCESS;
+        }
+    } else if (count <= room){
+        if (load_tail(file) == -1){
+            return E_UNKNOWN;
+        }
+        memcpy(&file->tail[fSize % BLOCK_SIZE], buf, count);
+        file->inode.contents.inode.file_size = fSize + count;
+        file->dirty = TRUE;
+        if (count == room){
+            // the block is full and won't change again
+            if (cache_write_block(file->tail_block_num, file->tail) == -1){
+                return E_UNKNOWN;
+            }
+            file->tail_valid = FALSE;
+        }
+        return E_SUCCESS;
+    }
+    if (flush_stream(file) == -1){
+        return E_UNKNOWN;
+    }
+    return write_file(file, buf, count, fSize);
+}
+
+// returns the open file behind handle, or NULL if handle isn't open (or is
+// an append stream)
+static struct file_handle* get_handle(int handle) {
+    if (handle < 0 || handle >= MAX_OPEN_FILES || !handles[handle].in_use ||
+        handles[handle].is_stream){
+        return NULL;
+    }
+    return &handles[handle];
+}
+
+// returns the append stream behind handle, or NULL if it isn't one
+static struct file_handle* get_stream(int handle) {
+    if (handle < 0 || handle >= MAX_OPEN_FILES || !handles[handle].in_use ||
+        !handles[handle].is_stream){
+        return NULL;
+    }
+    return &handles[handle];
+}
+
+
+/* count_nodes
+ *   helper function to count the files and directories in the tree under a
+ *   directory, the directory itself included
+ *
+ * returns the count, or -1 on failure
+ */
+static int64_t count_nodes(block_num_t dir_block_num);
+
+// for_each_entry() callback of count_nodes(), adding up into *arg
+static int count_entry_nodes(const struct dir_entry* entry, void* arg) {
+    int64_t* count = arg;
+    if (entry_is_dir(entry->type, entry->block_num)){
+        int64_t sub_count = count_nodes(entry->block_num);
+        if (sub_count == -1){
             return -1;
         }
+        *count += sub_count;
+    } else {
+        (*count)++;
     }
     return 0;
 }
 
+static int64_t count_nodes(block_num_t dir_block_num) {
+    int64_t count = 1;
+    if (for_each_entry(dir_block_num, count_entry_nodes, &count) != 0){
+        return -1;
+    }
+    return count;
+}
+
+
+// dirnode header of version 2 disks made before directories recorded their
+// parent (where the parent is now, they kept the hash depth)
+struct old_dirnode_header {
+    uint32_t is_dir;
+    uint16_t num_entries;
+    uint16_t flags;
+    uint32_t depth;
+    uint32_t total_entries;
+};
+
+/* convert_dirnode
+ *   helper function for add_dir_parents(): moves one dirnode to the current
+ *   header layout and sets its parent.  The dirnode is marked with
+ *   DIR_FLAG_UPGRADED (the old header has that bit of the flags clear), so
+ *   an upgrade cut short by a commit and a crash can be run again.  Each
+ *   dirnode is a transaction's worth of change on its own.
+ * node: receives the converted dirnode
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int convert_dirnode(block_num_t block_num, block_num_t parent, struct block* node) {
+    if (read_node(block_num, node) == -1){
+        return -1;
+    }
+    if (!(node->contents.dirnode.flags & DIR_FLAG_UPGRADED)){
+        struct old_dirnode_header old;
+        memcpy(&old, node, sizeof(old));
+        node->contents.dirnode.flags = old.flags | DIR_FLAG_UPGRADED;
+        node->contents.dirnode.depth = old.depth;
+        node->contents.dirnode.total_entries = old.total_entries;
+    }
+    node->contents.dirnode.parent = parent;
+    if (bfs_reserve(1, 0) == -1){
+        return -1;
+    }
+    return write_node(block_num, node);
+}
+
+/* add_dir_parents
+ *   helper function for disks made before directories recorded their
+ *   parent: moves every dirnode of the tree under a directory (buckets
+ *   included) to the current header layout, filling in the parents
+ *
+ * returns 0 on success, otherwise returns -1
+ */
+static int add_dir_parents(block_num_t dir_block_num, block_num_t parent);
+
+// for_each_entry() callback of add_dir_parents(); *arg is the directory
+static int add_entry_parents(const struct dir_entry* entry, void* arg) {
+    if (!entry_is_dir(entry->type, entry->block_num)){
+        return 0;
+    }
+    return add_dir_parents(entry->block_num, *(block_num_t*)arg);
+}
+
+static int add_dir_parents(block_num_t dir_block_num, block_num_t parent) {
+    struct block head;
+    if (convert_dirnode(dir_block_num, parent, &head) == -1){
+        return -1;
+    }
+    if (head.contents.dirnode.flags & DIR_FLAG_HASHED){
+        block_num_t* index = load_index(&head);
+        if (index == NULL){
+            return -1;
+        }
+        uint32_t count = (uint32_t)1 << head.contents.dirnode.depth;
+        int ret = 0;
+        for (uint32_t slot = 0; slot < count && ret == 0; slot++){
+            if (first_slot(index, slot)){
+                struct block bucket;
+                ret = convert_dirnode(index[slot], 0, &bucket);
+            }
+        }
+        free(index);
+        if (ret != 0){
+            return -1;
+        }
+    }
+    // now the subdirectories, whose entries can be read with the new layout
+    return for_each_entry(dir_block_num, add_entry_parents, &dir_block_num);
+}
+
+
+/* jfs_mkfs
+ *   creates a new, empty file system in a DISK file on the _real_ file
+ *   system, overwriting anything that was in it.  The file system must not be
+ *   mounted.  (jfs_mount() also creates one, with the default geometry, if
+ *   the DISK file doesn't exist yet.)
+ * filename - the name of the DISK file on the _real_ file system
+ * block_size - size of a block in bytes; a power of two between
+ *   MIN_BLOCK_SIZE and MAX_BLOCK_SIZE
+ * num_blocks - number of blocks on the disk, at most MAX_NUM_BLOCKS
+ * returns 0 on success or -1 on error (an invalid geometry, or an error in
+ *   the underlying disk syscalls)
+ */
+int jfs_mkfs(const char* filename, uint32_t block_size, uint32_t num_blocks) {
+  LOCK_FS(LOCK_EXCLUSIVE);
+  return bfs_mkfs(filename, block_size, num_blocks);
+}
+
+
+/* abandon_mount
+ *   helper function for jfs_mount(): undoes a mount that failed after
+ *   bfs_mount() succeeded, so the disk isn't left mounted
+ * returns -1
+ */
+static int abandon_mount() {
+    free(parent_table);
+    parent_table = NULL;
+    cache_unpin(bfs_root_block());
+    dcache_clear();
+    walk_generation++;
+    mount_count++;
+    bfs_unmount();
+    return -1;
+}
+
 
 /* jfs_mount
  *   prepares the DISK file on the _real_ file system to have file system
  *   blocks read and written to it.  The application _must_ call this function
  *   exactly once before calling any other jfs_* functions.  If your code
  *   requires any additional one-time initialization before any other jfs_*
- *   functions are called, you can add it here.
+ *   functions are called, you can add it here.  A journal commit that a
+ *   crash cut short is finished first.
  * filename - the name of the DISK file on the _real_ file system
  * returns 0 on success or -1 on error; errors should only occur due to
  *   errors in the underlying disk syscalls.
  */
 int jfs_mount(const char* filename) {
+  LOCK_FS(LOCK_EXCLUSIVE);
   int ret = bfs_mount(filename);
-  current_dir = 1;
+  if (ret < 0) {
+    return ret;
+  }
+  mount_count++;
+  cwd_count = 0;
+  pinned_cwds = 0;
+  dcache_clear();
+  memset(handles, 0, sizeof(handles));
+  pthread_once(&offset_locks_once, init_offset_locks);
+  walk_generation++;
+  wide_block_nums = raw_format_version() >= 2;
+
+  if (!wide_block_nums) {
+    // these dirnodes have no room for their parent; keep them in memory
+    parent_table = calloc(NUM_BLOCKS, sizeof(block_num_t));
+    if (parent_table == NULL) {
+      return abandon_mount();
+    }
+  } else if (!bfs_dir_parents_known()) {
+    // move older disks to the dirnode layout with parents, before anything
+    // reads a dirnode, and make that durable right away (it may be committed
+    // in parts; the disk is only marked as done once every dirnode is)
+    if (add_dir_parents(bfs_root_block(), bfs_root_block()) == -1) {
+      return abandon_mount();
+    }
+    bfs_set_dir_parents_known();
+    if (bfs_sync() < 0) {
+      return abandon_mount();
+    }
+  }
+
+  // the root directory is read by almost every call, so keep it resident
+  // in the block cache (working directories are pinned as they are set)
+  cache_pin(bfs_root_block());
+
+  // disks that don't keep a file count yet get one by walking the tree once
+  if (!bfs_inode_count_known()) {
+    int64_t count = count_nodes(bfs_root_block());
+    if (count == -1) {
+      return abandon_mount();
+    }
+    bfs_set_inode_count(count);
+  }
   return ret;
 }
 
 
+/* jfs_max_dir_entries / jfs_max_data_blocks / jfs_max_file_size
+ *   limits of the mounted disk, behind MAX_DIR_ENTRIES, MAX_DATA_BLOCKS and
+ *   MAX_FILE_SIZE
+ */
+size_t jfs_max_dir_entries() {
+  if (!wide_block_nums) {
+    return dir_block_entries();
+  }
+  // every bucket of the deepest index full
+  return ((size_t)1 << max_index_depth()) * dir_block_entries();
+}
+
+
+size_t jfs_max_data_blocks() {
+  return wide_block_nums ? DATA_BLOCKS_FOR(BLOCK_SIZE) : DATA_BLOCKS_16_FOR(BLOCK_SIZE);
+}
+
+
+size_t jfs_max_file_size() {
+  if (!wide_block_nums) {
+    return MAX_DATA_BLOCKS * BLOCK_SIZE;
+  }
+  // extent trees have no limit of their own; the size has to fit in 32 bits
+  return (UINT32_MAX / BLOCK_SIZE) * BLOCK_SIZE;
+}
+
+
 /* jfs_mkdir
- *   creates a new subdirectory in the current directory
- * directory_name - name of the new subdirectory
+ *   creates a new directory
+ * directory_name - path of the new directory
  * returns 0 on success or one of the following error codes on failure:
- *   E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL
+ *   E_NOT_EXISTS, E_NOT_DIR (for the directories on the way), E_EXISTS,
+ *   E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL
  */
 int jfs_mkdir(const char* directory_name) {
+    LOCK_FS(LOCK_EXCLUSIVE);
+    if (bfs_commit_point() == -1){
+        return E_UNKNOWN;
+    }
     /***** chekc errors (except E_DISK_FULL)******/
     // to store results of calling other functions
     int ret_temp;
     
-    // check if directory_name length too long
-    if (strlen(directory_name) > MAX_NAME_LENGTH){
-        return E_MAX_NAME_LENGTH;
-    }
-    
-    // get current folder block in current_dir
-    struct block cur_block;
-    bzero(&cur_block, sizeof(struct block));
-    ret_temp = read_block(current_dir, &cur_block);
-    if (ret_temp == -1){
+    // find the directory to make it in (this also checks if the new name is
+    // too long)
+    struct path_target path;
+    ret_temp = resolve_path(directory_name, &path);
+    if (ret_temp != E_SUCCESS){
         return ret_temp;
     }
+    if (path.is_dir_itself){
+        return E_EXISTS;
+    }
     
-    // get current number of entries in the current folder
-    uint16_t cur_entries = cur_block.contents.dirnode.num_entries;
-    
-    // check number of entries in the current_dir    
-    if (cur_entries >= MAX_DIR_ENTRIES){
+    // check number of entries in the directory
+    if (dir_is_full(path.dir)){
         return E_MAX_DIR_ENTRIES;
     }
     
     // check if name already exits
-    for (int i = 0; i < cur_entries; i++){
-        if (strcmp(cur_block.contents.dirnode.entries[i].name, directory_name)== 0){
-            return E_EXISTS;
-        }
+    struct dentry existing;
+    if (if_exist(path.dir, path.name, &existing) != -1){
+        return E_EXISTS;
     }
     
     /***** prepare and write the new directory + E_DISK_FULL******/
-    // allocate a block for the new directory
+    // allocate a block for the new directory, in a transaction with room for
+    // adding its entry
+    uint32_t cost = add_entry_cost(path.dir);
+    if (bfs_reserve(cost, cost) == -1){
+        return E_UNKNOWN;
+    }
+    if (bfs_free_blocks() == 0){
+        return E_DISK_FULL;
+    }
     block_num_t new_block_num = allocate_block();
     if (new_block_num == 0){
         // block full see allocate_block function
@@ -336,74 +2637,101 @@ int jfs_mkdir(const char* directory_name) {
     bzero(&new_block, sizeof(struct block));
     
     // clear the allocated block by writing the empty block to the disk
-    write_block(new_block_num, &new_block);    
+    cache_write_block(new_block_num, &new_block);    
     
     // fill in the meta data for the new directory (local)
     new_block.is_dir = 0;
     new_block.contents.dirnode.num_entries = 0;    
+    new_block.contents.dirnode.parent = path.dir;
     
     // write the new directory to the allocated block
-    if (write_block(new_block_num, (void *)&new_block) == -1){
+    if (write_node(new_block_num, &new_block) == -1){
         return E_UNKNOWN;
     }
     
-    /***** update the meta data of the current directory ******/
-    // update local copy: cur_block
-    uint16_t cur_num_entries = ++(cur_block.contents.dirnode.num_entries);
-    cur_block.contents.dirnode.entries[cur_num_entries-1].block_num = new_block_num;
-    strcpy(cur_block.contents.dirnode.entries[cur_num_entries-1].name,
-           directory_name);
-           
-    // write the current block
-    if (write_block(current_dir, (void *)&cur_block) == -1){
-        return E_UNKNOWN;
+    /***** add the entry to the current directory ******/
+    struct dir_entry new_entry;
+    memset(&new_entry, 0, sizeof(struct dir_entry));
+    new_entry.block_num = new_block_num;
+    new_entry.type = ENTRY_TYPE_DIR;
+    strcpy(new_entry.name, path.name);
+    
+    // a hashed directory may need blocks of its own to take the entry
+    ret_temp = add_entry(path.dir, &new_entry);
+    if (ret_temp != E_SUCCESS){
+        release_block(new_block_num);
+        return ret_temp;
     }
+    dcache_insert(path.dir, path.name, new_block_num, TRUE);
+    remember_parent(new_block_num, path.dir);
+    bfs_set_inode_count(bfs_inode_count() + 1);
     
   return E_SUCCESS;
 }
 
 
 /* jfs_chdir
- *   changes the current directory to the specified subdirectory, or changes
+ *   changes the current directory to the specified directory, or changes
  *   the current directory to the root directory if the directory_name is NULL
- * directory_name - name of the subdirectory to make the current
+ *   (every thread has a current directory of its own, which starts out as
+ *   the root)
+ * directory_name - path of the directory to make the current
  *   directory; if directory_name is NULL then the current directory
  *   should be made the root directory instead
  * returns 0 on success or one of the following error codes on failure:
  *   E_NOT_EXISTS, E_NOT_DIR
  */
 int jfs_chdir(const char* directory_name) {
+    LOCK_FS(LOCK_SHARED);
     // if null -> root
     if (directory_name == NULL){
-        current_dir = 1;
+        set_current_dir(bfs_root_block());
         return E_SUCCESS;
     }
     
-    // get current folder block in current_dir
-    struct block cur_block;
-    bzero(&cur_block, sizeof(struct block));
-    int ret_temp = read_block(current_dir, &cur_block);
-    if (ret_temp == -1){
-        return ret_temp;
-    }
-        
-    // check if name exits    
-    int target_index = if_exist(directory_name);
-    if (target_index != -1){
-        // found the same name
-        // check if it is a directory or not
-        block_num_t target_dir_num = 
-            cur_block.contents.dirnode.entries[target_index].block_num;
-        if (is_dir(target_dir_num)){
-            current_dir = target_dir_num;
-            return E_SUCCESS;
-        } else{
-            return E_NOT_DIR;
-        }
+    // check if the path leads anywhere
+    struct path_target path;
+    struct dentry target;
+    int ret = find_path(directory_name, &path, &target);
+    if (ret != E_SUCCESS){
+        return ret;
+    }
+    // check if it is a directory or not
+    if (!target.is_dir){
+        return E_NOT_DIR;
+    }
+    if (set_current_dir(target.child) == -1){
+        return E_UNKNOWN;
+    }
+    return E_SUCCESS;
+}
+
+
+// where jfs_ls() puts the names jfs_ls_each() hands it
+struct ls_arrays {
+    char** directories;
+    char** files;
+    int d; // next index of each array
+    int f;
+};
+
+static int ls_fill(const char* name, int is_directory, void* arg) {
+    struct ls_arrays* arrays = arg;
+    
+    // malloc a string and set a name in it
+    char *target_name = (char *) malloc((MAX_NAME_LENGTH + 1) * sizeof(char));
+    if (target_name == NULL) { 
+        // malloc fail
+        return E_UNKNOWN;
     }
+    strcpy(target_name, name);
     
-    // name not exist in the current directory
-    return E_NOT_EXISTS;
+    if (is_directory){
+        arrays->directories[arrays->d++] = target_name;
+    } else {
+        arrays->files[arrays->f++] = target_name;
+    }
+    return 0;
 }
 
 
@@ -417,105 +2745,104 @@ int jfs_chdir(const char* directory_name) {
  * file - array of strings; the function will set the strings in the
  *   array, followed by a NULL pointer after the last valid string; the strings
  *   should be malloced and the caller will free them
+ *   (both arrays need room for every entry of the directory plus the NULL;
+ *   MAX_DIR_ENTRIES + 1 always suffices, but jfs_ls_each() needs no arrays)
  * returns 0 on success or one of the following error codes on failure:
  *   (this function should always succeed)
  */
-int jfs_ls(char* directories[MAX_DIR_ENTRIES+1], char* files[MAX_DIR_ENTRIES+1]) {
-    // set the two results to NULL
-    for (size_t i = 0; i < MAX_DIR_ENTRIES + 1; i++) { 
-        directories[i] = NULL;
-        files[i] = NULL;
-    }
-    
-    // get current folder block in current_dir
-    struct block cur_block;
-    bzero(&cur_block, sizeof(struct block));
-    int ret_temp = read_block(current_dir, &cur_block);
-    if (ret_temp == -1){
-        return ret_temp;
-    }
-    
-    // get current number of entries in the current folder
-    uint16_t cur_entries = cur_block.contents.dirnode.num_entries;
-    
-    // start index of the two result arrays
-    int d = 0;
-    int f = 0;
-    
-    // go through each entries to get names for both files and directories
-    for (int i = 0; i < cur_entries; i++){
-        block_num_t target_block_num = 
-            cur_block.contents.dirnode.entries[i].block_num;
-            
-        // malloc a string and set a name in it
-        char *target_name = (char *) malloc((MAX_NAME_LENGTH + 1) * sizeof(char));
-        if (target_name == NULL) { 
-            // malloc fail
-            return E_UNKNOWN;
-        }
-        bzero(target_name, MAX_NAME_LENGTH + 1);
-        strcpy(target_name, cur_block.contents.dirnode.entries[i].name);
-        
-        // put name to the result arrays
-        if (is_dir(target_block_num)){
-            // dir
-            directories[d++] = target_name;
-        } else {
-            // file
-            files[f++] = target_name;
-        }
+int jfs_ls(char* directories[], char* files[]) {
+    LOCK_FS(LOCK_SHARED);
+    struct ls_arrays arrays = {directories, files, 0, 0};
+    int ret = jfs_ls_each(ls_fill, &arrays);
+    
+    // terminate the two results
+    directories[arrays.d] = NULL;
+    files[arrays.f] = NULL;
+  return ret;
+}
+
+
+// jfs_ls_each()'s callback, behind the for_each_entry() one
+struct ls_callback {
+    int (*fn)(const char* name, int is_dir, void* arg);
+    void* arg;
+};
+
+static int ls_visit(const struct dir_entry* entry, void* arg) {
+    struct ls_callback* callback = arg;
+    // the entry's type normally says which, without reading the target
+    int is_directory = entry_is_dir(entry->type, entry->block_num);
+    return callback->fn(entry->name, is_directory, callback->arg);
+}
+
+
+/* jfs_ls_each
+ *   streams the names of all the files and directories in the current
+ *   directory to a callback, in no particular order, reading every block of
+ *   the directory once
+ * fn - called once per entry with its name, 1 for a directory or 0 for a
+ *   file, and arg; it returns 0 to go on, or anything else to stop (it must
+ *   not change the file system)
+ * arg - passed through to fn
+ * returns 0 on success, the value fn stopped with, or E_UNKNOWN on error
+ */
+int jfs_ls_each(int (*fn)(const char* name, int is_dir, void* arg), void* arg) {
+    LOCK_FS(LOCK_SHARED);
+    struct ls_callback callback = {fn, arg};
+    int ret = for_each_entry(cwd(), ls_visit, &callback);
+    if (ret == -1){
+        return E_UNKNOWN;
     }
-  return E_SUCCESS;
+  return ret;
 }
 
 
 /* jfs_rmdir
- *   removes the specified subdirectory of the current directory
- * directory_name - name of the subdirectory to remove
+ *   removes the specified directory
+ * directory_name - path of the directory to remove
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_NOT_DIR, E_NOT_EMPTY
+ *   E_NOT_EXISTS, E_NOT_DIR, E_NOT_EMPTY, E_BAD_PATH (the path ends in "."
+ *   or "..", or names the root or the current directory of any thread)
  */
 int jfs_rmdir(const char* directory_name) {
-    // get current folder block in current_dir
-    struct block cur_block;
-    bzero(&cur_block, sizeof(struct block));
-    int ret_temp = read_block(current_dir, &cur_block);
-    if (ret_temp == -1){
-        return ret_temp;
+    LOCK_FS(LOCK_EXCLUSIVE);
+    if (bfs_commit_point() == -1){
+        return E_UNKNOWN;
     }
-    
-    // check if the name exist in the current directory
-    int target_index = if_exist(directory_name);
-    if (target_index == -1){
-        // name not exist
-        return E_NOT_EXISTS;
+    // check if the path leads anywhere
+    struct path_target path;
+    struct dentry target;
+    int ret = find_path(directory_name, &path, &target);
+    if (ret != E_SUCCESS){
+        return ret;
+    }
+    if (path.is_dir_itself || target.child == cwd() || is_any_cwd(target.child)){
+        return E_BAD_PATH;
     }
     
     // check if target is a directory
-    block_num_t target_block_num = 
-        cur_block.contents.dirnode.entries[target_index].block_num;
-    if (is_dir(target_block_num)){
+    block_num_t target_block_num = target.child;
+    if (target.is_dir){
         // dir
-        // get the target directory block into target_block
-        struct block target_block;
-        bzero(&target_block, sizeof(struct block));
-        ret_temp = read_block(target_block_num, &target_block);
-        if (ret_temp == -1) {
-            return ret_temp;
+        // check if the target directory is empty (an emptied hashed
+        // directory is a plain dir block again, so nothing else to release)
+        int64_t target_entries = count_entries(target_block_num);
+        if (target_entries == -1) {
+            return E_UNKNOWN;
         }
-        
-        // check if the target directory is empty
-        if (target_block.contents.dirnode.num_entries > 0) {
+        if (target_entries > 0) {
             return E_NOT_EMPTY;
         }
         
-        // remove the target directory (the entry in my current directory block)
+        // remove the target directory (the entry in its parent)
         // also release the deleted block
-        block_num_t deleted_block_num = 
-            remove_directory_entry(&cur_block, target_index);
+        block_num_t deleted_block_num = remove_directory_entry(path.dir, path.name);
         if (deleted_block_num == 0){
             return E_UNKNOWN;
         }
+        // its block may come back as a different directory
+        dcache_purge_dir(deleted_block_num);
+        walk_generation++;
     } else {
         // file
         return E_NOT_DIR;
@@ -527,46 +2854,53 @@ int jfs_rmdir(const char* directory_name) {
 
 
 /* jfs_creat
- *   creates a new, empty file with the specified name
- * file_name - name to give the new file
+ *   creates a new, empty file with the specified path
+ * file_name - path to give the new file
  * returns 0 on success or one of the following error codes on failure:
- *   E_EXISTS, E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL
+ *   E_NOT_EXISTS, E_NOT_DIR (for the directories on the way), E_EXISTS,
+ *   E_MAX_NAME_LENGTH, E_MAX_DIR_ENTRIES, E_DISK_FULL
  */
 int jfs_creat(const char* file_name) {
+    LOCK_FS(LOCK_EXCLUSIVE);
+    if (bfs_commit_point() == -1){
+        return E_UNKNOWN;
+    }
     /***** chekc errors (except E_DISK_FULL)******/
     // to store results of calling other functions
     int ret_temp;
     
-    // check if file_name length too long
-    if (strlen(file_name) > MAX_NAME_LENGTH){
-        return E_MAX_NAME_LENGTH;
-    }
-    
-    // get current folder block in current_dir
-    struct block cur_block;
-    bzero(&cur_block, sizeof(struct block));
-    ret_temp = read_block(current_dir, &cur_block);
-    if (ret_temp == -1){
+    // find the directory to make it in (this also checks if the new name is
+    // too long)
+    struct path_target path;
+    ret_temp = resolve_path(file_name, &path);
+    if (ret_temp != E_SUCCESS){
         return ret_temp;
     }
+    if (path.is_dir_itself){
+        return E_EXISTS;
+    }
     
-    // get current number of entries in the current folder
-    uint16_t cur_entries = cur_block.contents.dirnode.num_entries;
-    
-    // check number of entries in the current_dir    
-    if (cur_entries >= MAX_DIR_ENTRIES){
+    // check number of entries in the directory
+    if (dir_is_full(path.dir)){
         return E_MAX_DIR_ENTRIES;
     }
     
     // check if name already exits
-    for (int i = 0; i < cur_entries; i++){
-        if (strcmp(cur_block.contents.dirnode.entries[i].name, file_name)== 0){
-            return E_EXISTS;
-        }
+    struct dentry existing;
+    if (if_exist(path.dir, path.name, &existing) != -1){
+        return E_EXISTS;
     }
     
     /***** prepare and write the new file + E_DISK_FULL check******/
-    // allocate a block for the new file
+    // allocate a block for the new file, in a transaction with room for
+    // adding its entry
+    uint32_t cost = add_entry_cost(path.dir);
+    if (bfs_reserve(cost, cost) == -1){
+        return E_UNKNOWN;
+    }
+    if (bfs_free_blocks() == 0){
+        return E_DISK_FULL;
+    }
     block_num_t new_block_num = allocate_block();
     if (new_block_num == 0){
         // block full see allocate_block function
@@ -578,28 +2912,36 @@ int jfs_creat(const char* file_name) {
     bzero(&new_block, sizeof(struct block));
     
     // clear the allocated block by writing the empty block to the disk
-    write_block(new_block_num, &new_block);    
+    cache_write_block(new_block_num, &new_block);    
     
-    // fill in the meta data for the new file (local)
+    // fill in the meta data for the new file (local); where they can, new
+    // files start with an (empty) extent tree
     new_block.is_dir = 1;
     new_block.contents.inode.file_size = 0;    
+    if (wide_block_nums){
+        new_block.contents.inode.flags = INODE_FLAG_EXTENTS;
+    }
     
     // write the new file to the allocated block
-    if (write_block(new_block_num, (void *)&new_block) == -1){
+    if (write_node(new_block_num, &new_block) == -1){
         return E_UNKNOWN;
     }
     
-    /***** update the meta data of the current directory ******/
-    // update local copy: cur_block
-    uint16_t cur_num_entries = ++(cur_block.contents.dirnode.num_entries);
-    cur_block.contents.dirnode.entries[cur_num_entries-1].block_num = new_block_num;
-    strcpy(cur_block.contents.dirnode.entries[cur_num_entries-1].name,
-           file_name);
-           
-    // write the current block
-    if (write_block(current_dir, (void *)&cur_block) == -1){
-        return E_UNKNOWN;
+    /***** add the entry to the current directory ******/
+    struct dir_entry new_entry;
+    memset(&new_entry, 0, sizeof(struct dir_entry));
+    new_entry.block_num = new_block_num;
+    new_entry.type = ENTRY_TYPE_FILE;
+    strcpy(new_entry.name, path.name);
+    
+    // a hashed directory may need blocks of its own to take the entry
+    ret_temp = add_entry(path.dir, &new_entry);
+    if (ret_temp != E_SUCCESS){
+        release_block(new_block_num);
+        return ret_temp;
     }
+    dcache_insert(path.dir, path.name, new_block_num, FALSE);
+    bfs_set_inode_count(bfs_inode_count() + 1);
     
   return E_SUCCESS;
 }
@@ -608,39 +2950,35 @@ int jfs_creat(const char* file_name) {
 /* jfs_remove
  *   deletes the specified file and all its data (note that this cannot delete
  *   directories; use rmdir instead to remove directories)
- * file_name - name of the file to remove
+ * file_name - path of the file to remove
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_IS_DIR
+ *   E_NOT_EXISTS, E_NOT_DIR (for the directories on the way), E_IS_DIR
  */
 int jfs_remove(const char* file_name) {
-    
-    // get current folder block in current_dir
-    struct block cur_block;
-    bzero(&cur_block, sizeof(struct block));
-    int ret_temp = read_block(current_dir, &cur_block);
-    if (ret_temp == -1){
-        return ret_temp;
+    LOCK_FS(LOCK_EXCLUSIVE);
+    if (bfs_commit_point() == -1){
+        return E_UNKNOWN;
     }
+    int ret_temp;
     
-    // check if the name exist in the current directory
-    int target_index = if_exist(file_name);
-    if (target_index == -1){
-        // name not exist
-        return E_NOT_EXISTS;
+    // check if the path leads anywhere
+    struct path_target path;
+    struct dentry target;
+    ret_temp = find_path(file_name, &path, &target);
+    if (ret_temp != E_SUCCESS){
+        return ret_temp;
     }
     
     // check if target is a file
-    block_num_t target_block_num = 
-        cur_block.contents.dirnode.entries[target_index].block_num;
-    if (is_dir(target_block_num)){
+    block_num_t target_block_num = target.child;
+    if (target.is_dir){
         // dir
         return E_IS_DIR;
     } else {
         // file
         // get the target inode block into target_block
         struct block target_block;
-        bzero(&target_block, sizeof(struct block));
-        ret_temp = read_block(target_block_num, &target_block);
+        ret_temp = read_node(target_block_num, &target_block);
         if (ret_temp == -1) {
             return ret_temp;
         }
@@ -655,11 +2993,17 @@ int jfs_remove(const char* file_name) {
                 return ret_temp;
             }
         }
-        block_num_t deleted_block_num = 
-            remove_directory_entry(&cur_block, target_index);
+        block_num_t deleted_block_num = remove_directory_entry(path.dir, path.name);
         if (deleted_block_num == 0){
             return E_UNKNOWN;
         }
+        
+        // handles still open on the file have nothing to refer to now
+        for (int i = 0; i < MAX_OPEN_FILES; i++){
+            if (handles[i].in_use && handles[i].inode_block_num == target_block_num){
+                handles[i].removed = TRUE;
+            }
+        }
     }
   return E_SUCCESS;
 }
@@ -667,35 +3011,31 @@ int jfs_remove(const char* file_name) {
 
 /* jfs_stat
  *   returns the file or directory stats (see struct stat for details)
- * name - name of the file or directory to inspect
+ * name - path of the file or directory to inspect (the stats give the last
+ *   component as its name)
  * buf  - pointer to a struct stat (already allocated by the caller) where the
  *   stats will be written
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS
+ *   E_NOT_EXISTS, E_NOT_DIR (for the directories on the way)
  */
 int jfs_stat(const char* name, struct stats* buf) {
-    // get current folder block in current_dir
-    struct block cur_block;
-    bzero(&cur_block, sizeof(struct block));
-    int ret_temp = read_block(current_dir, &cur_block);
-    if (ret_temp == -1){
-        return ret_temp;
-    }
-    
-    // check if the name exist in the current directory
-    int target_index = if_exist(name);
-    if (target_index == -1){
-        // name not exist
-        return E_NOT_EXISTS;
+    LOCK_FS(LOCK_LOOKUP);
+    // check if the path leads anywhere
+    struct path_target path;
+    struct dentry target;
+    int ret = find_path(name, &path, &target);
+    if (ret != E_SUCCESS){
+        return ret;
     }
     
     // get target block num
-    block_num_t target_block_num = 
-        cur_block.contents.dirnode.entries[target_index].block_num;
+    block_num_t target_block_num = target.child;
     // get the target inode/dirnode block into target_block
     struct block target_block;
-    bzero(&target_block, sizeof(struct block));
-    ret_temp = read_block(target_block_num, &target_block);
+    if (flush_streams(target_block_num, NULL) == -1){
+        return E_UNKNOWN;
+    }
+    int ret_temp = read_node(target_block_num, &target_block);
     if (ret_temp == -1) {
         return ret_temp;
     }
@@ -704,14 +3044,11 @@ int jfs_stat(const char* name, struct stats* buf) {
     bzero(buf, sizeof(struct stats));
     // write buf
     (*buf).is_dir = target_block.is_dir;
-    strcpy((*buf).name,
-           cur_block.contents.dirnode.entries[target_index].name);
+    strcpy((*buf).name, path.name);
     (*buf).block_num = target_block_num;
     if (target_block.is_dir != 0){
-        uint32_t fSize = target_block.contents.inode.file_size;
-        (*buf).num_data_blocks = 
-            (fSize + BLOCK_SIZE - 1)/BLOCK_SIZE; // ceiling division
-        (*buf).file_size = fSize;
+        (*buf).num_data_blocks = file_data_blocks(&target_block);
+        (*buf).file_size = target_block.contents.inode.file_size;
     }
     
   return E_SUCCESS;
@@ -720,75 +3057,51 @@ int jfs_stat(const char* name, struct stats* buf) {
 
 /* jfs_write
  *   appends the data in the buffer to the end of the specified file
- * file_name - name of the file to append data to
+ * file_name - path of the file to append data to
  * buf - buffer containing the data to be written (note that the data could be
  *   binary, not text, and even if it is text should not be assumed to be null
  *   terminated)
  * count - number of bytes in buf (write exactly this many)
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_IS_DIR, E_MAX_FILE_SIZE, E_DISK_FULL
+ *   E_NOT_EXISTS, E_NOT_DIR, E_IS_DIR, E_MAX_FILE_SIZE, E_DISK_FULL
  */
 int jfs_write(const char* file_name, const void* buf, unsigned short count) {
-    // get current folder block in current_dir
-    struct block cur_block;
-    bzero(&cur_block, sizeof(struct block));
-    int ret_temp = read_block(current_dir, &cur_block);
-    if (ret_temp == -1){
-        return ret_temp;
+    LOCK_FS(LOCK_EXCLUSIVE);
+    if (bfs_commit_point() == -1){
+        return E_UNKNOWN;
     }
-    
-    // check if the name exist in the current directory
-    int target_index = if_exist(file_name);
-    if (target_index == -1){
-        // name not exist
-        return E_NOT_EXISTS;
+    struct file_handle file;
+    int ret = open_file(file_name, &file);
+    if (ret != E_SUCCESS){
+        return ret;
     }
-    
-    // get target block num
-    block_num_t target_block_num = 
-        cur_block.contents.dirnode.entries[target_index].block_num;
-        
-    // check if target is a file
-    if (is_dir(target_block_num)){
-        // dir
-        return E_IS_DIR;
-    } else {
-        // file
-        // get the target inode block into target_block
-        struct block target_block;
-        bzero(&target_block, sizeof(struct block));
-        ret_temp = read_block(target_block_num, &target_block);
-        if (ret_temp == -1) {
-            return ret_temp;
-        }
-        
-        // check max file size error
-        // get current file size
-        uint32_t cur_fSize = target_block.contents.inode.file_size;
-        uint32_t new_size = cur_fSize + count;
-        if (new_size > MAX_FILE_SIZE){
-            return E_MAX_FILE_SIZE;
-        }
-        
-        // write data blocks
-        int write_result = write_data_blocks(&target_block, buf, count);
-        if (write_result != 0){
-            if (write_result == -2){
-                // full error
-                return E_DISK_FULL;
-            } else {
-                // -1
-                return E_UNKNOWN;
-            }
-        }
-        
-        // write the inode to disk
-        write_result = write_block(target_block_num, &target_block);
-        if (write_result == -1){
-            return E_UNKNOWN;
-        }
+    return write_file(&file, buf, count, file.inode.contents.inode.file_size);
+}
+
+
+/* jfs_pwrite
+ *   writes the data in the buffer into the specified file at the given byte
+ *   offset, overwriting what is there and growing the file as needed (with
+ *   zeros, if offset is past the end of the file)
+ * file_name - path of the file to write to
+ * buf - buffer containing the data to be written
+ * count - number of bytes in buf (write exactly this many)
+ * offset - where in the file the data goes
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_NOT_DIR, E_IS_DIR, E_MAX_FILE_SIZE, E_DISK_FULL (in which
+ *   case the file may have been written in part)
+ */
+int jfs_pwrite(const char* file_name, const void* buf, size_t count, uint64_t offset) {
+    LOCK_FS(LOCK_EXCLUSIVE);
+    if (bfs_commit_point() == -1){
+        return E_UNKNOWN;
     }
-  return E_SUCCESS;
+    struct file_handle file;
+    int ret = open_file(file_name, &file);
+    if (ret != E_SUCCESS){
+        return ret;
+    }
+    return write_file(&file, buf, count, offset);
 }
 
 
@@ -796,94 +3109,343 @@ int jfs_write(const char* file_name, const void* buf, unsigned short count) {
  *   reads the specified file and copies its contents into the buffer, up to a
  *   maximum of *ptr_count bytes copied (but obviously no more than the file
  *   size, either)
- * file_name - name of the file to read
+ * file_name - path of the file to read
  * buf - buffer where the file data should be written
  * ptr_count - pointer to a count variable (allocated by the caller) that
  *   contains the size of buf when it's passed in, and will be modified to
  *   contain the number of bytes actually written to buf (e.g., if the file is
  *   smaller than the buffer) if this function is successful
  * returns 0 on success or one of the following error codes on failure:
- *   E_NOT_EXISTS, E_IS_DIR
+ *   E_NOT_EXISTS, E_NOT_DIR, E_IS_DIR
  */
 int jfs_read(const char* file_name, void* buf, unsigned short* ptr_count) {
-    // get current folder block in current_dir
-    struct block cur_block;
-    bzero(&cur_block, sizeof(struct block));
-    int ret_temp = read_block(current_dir, &cur_block);
-    if (ret_temp == -1){
-        return ret_temp;
+    LOCK_FS(LOCK_LOOKUP);
+    size_t count = *ptr_count;
+    int ret = jfs_pread(file_name, buf, &count, 0);
+    if (ret == E_SUCCESS){
+        *ptr_count = count;
     }
-    
-    // check if the name exist in the current directory
-    int target_index = if_exist(file_name);
-    if (target_index == -1){
-        // name not exist
+    return ret;
+}
+
+
+/* jfs_pread
+ *   copies up to *ptr_count bytes of the specified file, starting at the
+ *   given byte offset, into the buffer; only the data blocks holding those
+ *   bytes are read
+ * file_name - path of the file to read
+ * buf - buffer where the file data should be written
+ * ptr_count - pointer to a count variable (allocated by the caller) that
+ *   contains the size of buf when it's passed in, and will be modified to
+ *   contain the number of bytes actually written to buf (0 if offset is at
+ *   or past the end of the file)
+ * offset - where in the file to start
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_NOT_EXISTS, E_NOT_DIR, E_IS_DIR
+ */
+int jfs_pread(const char* file_name, void* buf, size_t* ptr_count, uint64_t offset) {
+    LOCK_FS(LOCK_LOOKUP);
+    struct file_handle file;
+    int ret = open_file(file_name, &file);
+    if (ret != E_SUCCESS){
+        return ret;
+    }
+    if (read_file(&file, buf, ptr_count, offset) == -1){
+        return E_UNKNOWN;
+    }
+  return E_SUCCESS;
+}
+
+
+/* jfs_open
+ *   opens the specified file for jfs_hread(), jfs_hwrite() and jfs_hseek(),
+ *   positioned at its start.  The path is only looked up here, so the handle
+ *   keeps working after a jfs_chdir().
+ * file_name - path of the file to open
+ * returns a handle (>= 0) on success or one of the following error codes on
+ *   failure: E_NOT_EXISTS, E_NOT_DIR, E_IS_DIR, E_MAX_OPEN_FILES
+ */
+int jfs_open(const char* file_name) {
+    LOCK_FS(LOCK_EXCLUSIVE);
+    for (int i = 0; i < MAX_OPEN_FILES; i++){
+        if (!handles[i].in_use){
+            int ret = open_file(file_name, &handles[i]);
+            return (ret == E_SUCCESS) ? i : ret;
+        }
+    }
+    return E_MAX_OPEN_FILES;
+}
+
+
+/* jfs_hread
+ *   like jfs_pread(), but reads from an open file at its current offset and
+ *   moves the offset past the bytes read
+ * handle - returned by jfs_open()
+ * buf - buffer where the file data should be written
+ * ptr_count - pointer to a count variable (allocated by the caller) that
+ *   contains the size of buf when it's passed in, and will be modified to
+ *   contain the number of bytes actually written to buf (0 at the end of the
+ *   file)
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_BAD_HANDLE, E_NOT_EXISTS (the file was removed)
+ */
+int jfs_hread(int handle, void* buf, size_t* ptr_count) {
+    LOCK_FS(LOCK_LOOKUP);
+    struct file_handle* file = get_handle(handle);
+    if (file == NULL){
+        return E_BAD_HANDLE;
+    }
+    if (file->removed){
         return E_NOT_EXISTS;
     }
-    
-    // get target block num
-    block_num_t target_block_num = 
-        cur_block.contents.dirnode.entries[target_index].block_num;
-        
-    // check if target is a file
-    if (is_dir(target_block_num)){
-        // dir
-        return E_IS_DIR;
+    if (flush_streams(file->inode_block_num, NULL) == -1){
+        return E_UNKNOWN;
+    }
+    pthread_mutex_lock(&offset_locks[handle]);
+    int ret = read_file(file, buf, ptr_count, file->offset);
+    if (ret == 0){
+        file->offset += *ptr_count;
+    }
+    pthread_mutex_unlock(&offset_locks[handle]);
+    return (ret == 0) ? E_SUCCESS : E_UNKNOWN;
+}
+
+
+/* jfs_hwrite
+ *   like jfs_pwrite(), but writes to an open file at its current offset and
+ *   moves the offset past the bytes written.  Small appends that fit in the
+ *   file's last data block only write that block and the inode.
+ * handle - returned by jfs_open()
+ * buf - buffer containing the data to be written
+ * count - number of bytes in buf (write exactly this many)
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_BAD_HANDLE, E_NOT_EXISTS (the file was removed), E_MAX_FILE_SIZE,
+ *   E_DISK_FULL (in which case the file may have been written in part, and
+ *   the offset is left where it was)
+ */
+int jfs_hwrite(int handle, const void* buf, size_t count) {
+    LOCK_FS(LOCK_EXCLUSIVE);
+    if (bfs_commit_point() == -1){
+        return E_UNKNOWN;
+    }
+    struct file_handle* file = get_handle(handle);
+    if (file == NULL){
+        return E_BAD_HANDLE;
+    }
+    if (file->removed){
+        return E_NOT_EXISTS;
+    }
+    if (flush_streams(file->inode_block_num, NULL) == -1){
+        return E_UNKNOWN;
+    }
+    int ret = write_file(file, buf, count, file->offset);
+    if (ret == E_SUCCESS){
+        file->offset += count;
+    }
+    return ret;
+}
+
+
+/* jfs_hseek
+ *   moves the offset of an open file, which may be past the end of the file
+ *   (a jfs_hwrite() there fills the gap with zeros)
+ * handle - returned by jfs_open()
+ * offset - where to move, relative to whence
+ * whence - SEEK_SET (the start of the file), SEEK_CUR (the current offset)
+ *   or SEEK_END (the end of the file), as for lseek()
+ * returns the new offset on success or one of the following error codes on
+ *   failure: E_BAD_HANDLE, E_NOT_EXISTS (the file was removed), E_BAD_OFFSET
+ */
+int64_t jfs_hseek(int handle, int64_t offset, int whence) {
+    LOCK_FS(LOCK_LOOKUP);
+    struct file_handle* file = get_handle(handle);
+    if (file == NULL){
+        return E_BAD_HANDLE;
+    }
+    if (file->removed){
+        return E_NOT_EXISTS;
+    }
+    if (flush_streams(file->inode_block_num, NULL) == -1){
+        return E_UNKNOWN;
+    }
+    pthread_mutex_lock(&offset_locks[handle]);
+    int64_t base;
+    int64_t ret = E_SUCCESS;
+    if (whence == SEEK_SET){
+        base = 0;
+    } else if (whence == SEEK_CUR){
+        base = file->offset;
+    } else if (whence == SEEK_END){
+        base = file->inode.contents.inode.file_size;
     } else {
-        // file
-        // get the target inode block into target_block
-        struct block target_block;
-        bzero(&target_block, sizeof(struct block));
-        ret_temp = read_block(target_block_num, &target_block);
-        if (ret_temp == -1) {
-            return ret_temp;
-        }
-        
-        // get filesize
-        uint32_t fSize = target_block.contents.inode.file_size;
-        
-        // update count
-        if ((*ptr_count) > fSize){
-            *ptr_count = fSize;
-        }
-        
-        // copy buf
-        int block_amount = 
-            (fSize + BLOCK_SIZE - 1)/BLOCK_SIZE; // ceiling division
-        int left = *ptr_count;
-        int cur_block_index = 0; // mark which block we have get to
-        int buf_index = 0; // mark where to start to fill in buf
-        char* buf_ptr = (char*)buf;
-        while (cur_block_index < block_amount && left > 0){
-            // get this data block
-            block_num_t data_block_num = 
-                target_block.contents.inode.data_blocks[cur_block_index];
-            struct block data_block;
-            bzero(&data_block, sizeof(struct block));
-            int ret_temp = read_block(data_block_num, &data_block);
-            
-            if (ret_temp == -1){
-                return ret_temp;
-            }
-            if (left >= BLOCK_SIZE){
-                // copy the whole block
-                memcpy(&(buf_ptr[buf_index]), &data_block, BLOCK_SIZE);
-                left = left - BLOCK_SIZE;
-                buf_index = buf_index + BLOCK_SIZE;
-            } else {
-                // copy left
-                memcpy(&(buf_ptr[buf_index]), &data_block, left);
-                left = 0;
-                buf_index = buf_index + left;
-            }
-            cur_block_index++;
-        }
-            
+        ret = E_BAD_OFFSET;
+    }
+    if (ret == E_SUCCESS && (offset < -base || offset > INT64_MAX - base)){
+        ret = E_BAD_OFFSET;
+    }
+    if (ret == E_SUCCESS){
+        file->offset = base + offset;
+        ret = file->offset;
+    }
+    pthread_mutex_unlock(&offset_locks[handle]);
+    return ret;
+}
+
+
+/* jfs_close
+ *   closes a handle returned by jfs_open(); its number may be handed out
+ *   again by a later jfs_open()
+ * handle - the handle to close
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_BAD_HANDLE
+ */
+int jfs_close(int handle) {
+    LOCK_FS(LOCK_EXCLUSIVE);
+    struct file_handle* file = get_handle(handle);
+    if (file == NULL){
+        return E_BAD_HANDLE;
+    }
+    file->in_use = FALSE;
+    return E_SUCCESS;
+}
+
+
+/* jfs_append_open
+ *   opens the specified file as an append stream for jfs_append().  The
+ *   stream keeps the file's inode and partly filled last data block in
+ *   memory, so a small append costs no I/O: a data block is written when it
+ *   fills, and the inode by jfs_append_close() or jfs_sync() (or as soon as
+ *   anything else accesses the file).
+ * file_name - path of the file to open
+ * returns a handle (>= 0) on success or one of the following error codes on
+ *   failure: E_NOT_EXISTS, E_NOT_DIR, E_IS_DIR, E_MAX_OPEN_FILES
+ */
+int jfs_append_open(const char* file_name) {
+    LOCK_FS(LOCK_EXCLUSIVE);
+    int handle = jfs_open(file_name);
+    if (handle >= 0){
+        handles[handle].is_stream = TRUE;
+    }
+    return handle;
+}
+
+
+/* jfs_append
+ *   appends data to the end of the file of an append stream
+ * handle - returned by jfs_append_open()
+ * buf - buffer containing the data to be appended
+ * count - number of bytes in buf (append exactly this many)
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_BAD_HANDLE, E_NOT_EXISTS (the file was removed), E_MAX_FILE_SIZE,
+ *   E_DISK_FULL (in which case the file may have been written in part)
+ */
+int jfs_append(int handle, const void* buf, size_t count) {
+    LOCK_FS(LOCK_EXCLUSIVE);
+    if (bfs_commit_point() == -1){
+        return E_UNKNOWN;
+    }
+    struct file_handle* file = get_stream(handle);
+    if (file == NULL){
+        return E_BAD_HANDLE;
+    }
+    if (file->removed){
+        return E_NOT_EXISTS;
+    }
+    // only one stream on a file can hold anything back
+    if (flush_streams(file->inode_block_num, file) == -1){
+        return E_UNKNOWN;
+    }
+    return append_to_stream(file, buf, count);
+}
+
+
+/* jfs_append_close
+ *   writes back what an append stream holds and closes it; its number may
+ *   be handed out again by a later jfs_open() or jfs_append_open()
+ * handle - the stream to close
+ * returns 0 on success or one of the following error codes on failure:
+ *   E_BAD_HANDLE
+ */
+int jfs_append_close(int handle) {
+    LOCK_FS(LOCK_EXCLUSIVE);
+    if (bfs_commit_point() == -1){
+        return E_UNKNOWN;
     }
+    struct file_handle* file = get_stream(handle);
+    if (file == NULL){
+        return E_BAD_HANDLE;
+    }
+    int ret = (flush_stream(file) == -1) ? E_UNKNOWN : E_SUCCESS;
+    file->in_use = FALSE;
+    return ret;
+}
+
+
+/* jfs_statfs
+ *   reports how full the disk is, without scanning anything
+ * buf - pointer to a struct fs_stats (already allocated by the caller) where
+ *   the numbers will be written
+ * returns 0 on success (this function should always succeed)
+ */
+int jfs_statfs(struct fs_stats* buf) {
+  LOCK_FS(LOCK_SHARED);
+  bzero(buf, sizeof(struct fs_stats));
+  buf->block_size = BLOCK_SIZE;
+  buf->total_blocks = NUM_BLOCKS;
+  buf->free_blocks = bfs_free_blocks();
+  buf->used_blocks = NUM_BLOCKS - buf->free_blocks;
+  buf->num_inodes = bfs_inode_count();
+  return E_SUCCESS;
+}
+
+
+/* jfs_batch_begin
+ *   starts a batch: the changes of the operations that follow (directory
+ *   blocks, inodes, the bitmap) build up in memory and are written together
+ *   by jfs_batch_commit(), rather than once per commit window (or, on a disk
+ *   without a journal, once per flush interval).  Each operation still
+ *   returns its own error code, and one that fails doesn't undo the others.
+ *   Calling it again before jfs_batch_commit() changes nothing.
+ * returns 0 (this function should always succeed)
+ */
+int jfs_batch_begin() {
+  LOCK_FS(LOCK_EXCLUSIVE);
+  bfs_begin_batch();
   return E_SUCCESS;
 }
 
 
+/* jfs_batch_commit
+ *   ends the batch started by jfs_batch_begin() and writes everything it
+ *   changed, as jfs_sync() does
+ * returns 0 on success or -1 on error; errors should only occur due to
+ *   errors in the underlying disk syscalls.
+ */
+int jfs_batch_commit() {
+  LOCK_FS(LOCK_EXCLUSIVE);
+  bfs_end_batch();
+  return jfs_sync();
+}
+
+
+/* jfs_sync
+ *   writes all file system changes that are still buffered in memory back to
+ *   the DISK file, and makes them durable (on a disk with a journal, as one
+ *   more transaction; see bfs_set_commit_interval()).  jfs_unmount() does
+ *   this automatically.
+ * returns 0 on success or -1 on error; errors should only occur due to
+ *   errors in the underlying disk syscalls.
+ */
+int jfs_sync() {
+  LOCK_FS(LOCK_EXCLUSIVE);
+  int ret = flush_streams(0, NULL);
+  if (bfs_sync() == -1) {
+    ret = -1;
+  }
+  return ret;
+}
+
+
 /* jfs_unmount
  *   makes the file system no longer accessible (unless it is mounted again).
  *   This should be called exactly once after all other jfs_* operations are
@@ -895,6 +3457,19 @@ int jfs_read(const char* file_name, void* buf, unsigned short* ptr_count) {
  *   errors in the underlying disk syscalls.
  */
 int jfs_unmount() {
+  LOCK_FS(LOCK_EXCLUSIVE);
+  int flushed = flush_streams(0, NULL);
+  dcache_clear();
+  memset(handles, 0, sizeof(handles));
+  walk_generation++;
+  mount_count++;
+  cwd_count = 0;
+  pinned_cwds = 0;
+  free(cwd_list);
+  cwd_list = NULL;
+  cwd_capacity = 0;
+  free(parent_table);
+  parent_table = NULL;
   int ret = bfs_unmount();
-  return ret;
+  return (flushed == -1) ? -1 : ret;
 }
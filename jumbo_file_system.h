@@ -7,14 +7,107 @@
 // maximum number of characters in a file or directory name (not counting '\0')
 #define MAX_NAME_LENGTH 7
 
+// An inode or dirnode starts with a 16-byte header (the type, then the file
+// size or entry count, then reserved words that must be 0), followed by
+// data block numbers or directory entries.
+#define NODE_HEADER_SIZE 16
+
+// values of dir_entry.type
+#define ENTRY_TYPE_UNKNOWN 0 // written before types were stored; read the child to find out
+#define ENTRY_TYPE_DIR 1
+#define ENTRY_TYPE_FILE 2
+
+// One directory entry.  The padding keeps entries 16 bytes long, so every
+// name starts 8-byte aligned.
+struct dir_entry {
+  block_num_t block_num;          // block where the file's inode or directory's dir block is stored
+  uint8_t type;                   // ENTRY_TYPE_*, so the type is known without reading the block
+  uint8_t reserved[3];            // must be 0
+  char name[MAX_NAME_LENGTH + 1]; // +1 for the '\0' character
+};
+
+// number of directory entries / data block numbers that fit in a dirnode /
+// inode of the given block size
+#define DIR_ENTRIES_FOR(block_size) (((block_size) - NODE_HEADER_SIZE) / sizeof(struct dir_entry))
+#define DATA_BLOCKS_FOR(block_size) (((block_size) - NODE_HEADER_SIZE) / sizeof(block_num_t))
+
+// A directory starts out as a single dirnode.  On disks with 32-bit block
+// numbers, once that is full the directory becomes hashed: its dirnode (the
+// head) then lists index blocks holding an extendible hash index of
+// 2^depth bucket block numbers, and the entries live in the buckets, which
+// are dirnodes of their own.  A name is always in the bucket picked by the
+// low depth bits of its hash, so a lookup reads at most three blocks.
+#define DIR_FLAG_HASHED 1 // a head: the entries are in the buckets
+#define DIR_FLAG_BUCKET 2 // a bucket of a hashed directory, not a directory itself
+#define DIR_FLAG_UPGRADED 4 // already has the header with the parent (only looked at
+                            // while jfs_mount() upgrades a disk made before that)
+
+// On disks with 32-bit block numbers a directory's dirnode (its head, if
+// hashed) also records its parent directory, so ".." needs no search; disks
+// made before then have their dirnodes moved to this layout at the first
+// mount (see SB_HAS_DIR_PARENTS).
+
+// On disks with 32-bit block numbers a file's data blocks are described by
+// an extent tree rooted in its inode (INODE_FLAG_EXTENTS); files written
+// before then list their blocks directly until they next grow.  A leaf holds
+// extents; an interior node holds one record per child, giving the first
+// file block the child covers and where the child is.
+#define INODE_FLAG_EXTENTS 1
+
+// On those disks a file small enough to fit where the block numbers or
+// extents would go keeps its bytes there instead (INODE_FLAG_INLINE), and
+// has no data blocks until it outgrows the inode.
+#define INODE_FLAG_INLINE 2
+
+// one record of an extent tree node
+struct extent {
+  uint32_t logical;  // first block of the file it covers
+  uint32_t length;   // number of blocks (0 in interior nodes)
+  block_num_t start; // first disk block of the extent, or the child node
+};
+
+// header of an extent tree node
+struct extent_header {
+  uint16_t num_entries;
+  uint16_t depth; // 0 for a leaf, otherwise the height above the leaves
+};
+
+// number of records in an extent tree node (the root in an inode, or an
+// extent block) of the given block size
+#define EXTENTS_FOR(block_size) (((block_size) - NODE_HEADER_SIZE) / sizeof(struct extent))
+
+// an extent tree node below the root
+struct extent_block {
+  struct extent_header header;
+  uint32_t reserved[3]; // must be 0
+  struct extent records[EXTENTS_FOR(MAX_BLOCK_SIZE)];
+};
+
+// number of bucket block numbers in one index block of the given block size
+#define INDEX_ENTRIES_FOR(block_size) ((block_size) / sizeof(block_num_t))
+
+// the same for disks that store 16-bit block numbers (format version 1 and
+// legacy disks), whose nodes have no reserved words and 10-byte entries
+#define DIR_ENTRIES_16_FOR(block_size) (((block_size) - sizeof(uint16_t) - sizeof(uint32_t)) / (sizeof(uint16_t) + MAX_NAME_LENGTH + 1))
+#define DATA_BLOCKS_16_FOR(block_size) (((block_size) - sizeof(uint32_t) - sizeof(uint32_t)) / sizeof(uint16_t))
+
 // maximum number of (combined total) files and subdirectories that can be in a directory
-#define MAX_DIR_ENTRIES ((BLOCK_SIZE - sizeof(uint16_t) - sizeof(uint32_t)) / (sizeof(block_num_t) + MAX_NAME_LENGTH + 1))
+// (depends on the block size and format of the mounted disk; a hashed
+// directory can run out of room a little earlier if its names hash unevenly)
+#define MAX_DIR_ENTRIES (jfs_max_dir_entries())
 
-// maximum number of data blocks that can be used to store a file
-#define MAX_DATA_BLOCKS ((BLOCK_SIZE - sizeof(uint32_t) - sizeof(uint32_t)) / sizeof(block_num_t))
+// maximum number of data block numbers an inode lists directly
+// (depends on the block size and format of the mounted disk)
+#define MAX_DATA_BLOCKS (jfs_max_data_blocks())
 
 // maximum size (in bytes) that a file can be
-#define MAX_FILE_SIZE (MAX_DATA_BLOCKS * BLOCK_SIZE)
+// (MAX_DATA_BLOCKS * BLOCK_SIZE on disks with 16-bit block numbers; nearly
+// 4 GB with extent trees)
+#define MAX_FILE_SIZE (jfs_max_file_size())
+
+// maximum number of files that can be open (with jfs_open() or
+// jfs_append_open()) at once
+#define MAX_OPEN_FILES 16
 
 
 // Struct returned by jfs_stat()
@@ -22,38 +115,76 @@ struct stats {
   uint32_t is_dir;                // 0 if it is a directory, 1 if it is a regular file
   char name[MAX_NAME_LENGTH + 1]; // +1 for the '\0' character
   block_num_t block_num;          // of the dir block, or the inode (for regular files)
-  uint16_t num_data_blocks;       // not counting the inode (ignored if is_dir is 0)
+  uint32_t num_data_blocks;       // not counting the inode, so 0 for a file kept in it (ignored if is_dir is 0)
   uint32_t file_size;             // in bytes (ignored if is_dir is 0)
 };
 
 
-// This is the data stored in an inode or directory block (dirnode)
+// Struct returned by jfs_statfs()
+struct fs_stats {
+  uint32_t block_size;   // in bytes
+  uint32_t total_blocks; // on the whole disk, metadata included
+  uint32_t free_blocks;
+  uint32_t used_blocks;
+  uint32_t num_inodes;   // files and directories, the root directory included
+};
+
+
+// This is the data stored in an inode or directory block (dirnode).  The
+// arrays are sized for the largest block size (and the 16-bit layouts, which
+// fit more); on a mounted disk only the records that fit in BLOCK_SIZE
+// bytes exist.  On disks with 32-bit block numbers the
+// first BLOCK_SIZE bytes of the struct are exactly what is on the disk; 16-bit
+// nodes are converted to and from it by jumbo_file_system.c.
 struct block {
   uint32_t is_dir; // 0 if it is a directory, 1 if it is a regular file
 
   union {
     struct {
       uint32_t file_size; // in bytes
-      block_num_t data_blocks[MAX_DATA_BLOCKS];
+      uint16_t flags;     // INODE_FLAG_*
+      uint16_t reserved16;
+      struct extent_header extent_header; // root of the extent tree (INODE_FLAG_EXTENTS)
+      union {
+        block_num_t data_blocks[DATA_BLOCKS_16_FOR(MAX_BLOCK_SIZE)];
+        struct extent extents[EXTENTS_FOR(MAX_BLOCK_SIZE)]; // INODE_FLAG_EXTENTS
+        char data[MAX_BLOCK_SIZE - NODE_HEADER_SIZE];       // INODE_FLAG_INLINE
+      };
     } inode;
 
     struct {
-      uint16_t num_entries; // must be <= MAX_DIR_ENTRIES
-      struct {
-        block_num_t block_num; // block where the file's inode or directory's dir block is stored
-        char name[MAX_NAME_LENGTH + 1]; // +1 for the '\0' character
-      } entries[MAX_DIR_ENTRIES];
+      uint16_t num_entries;   // entries in this block (0 in the head of a hashed directory)
+      uint8_t flags;          // DIR_FLAG_*
+      uint8_t depth;          // bits of the name hash used by a head's index or told apart by a bucket
+      block_num_t parent;     // dir block of the directory holding this one (not in buckets)
+      uint32_t total_entries; // entries in the whole directory (heads only)
+      union {
+        struct dir_entry entries[DIR_ENTRIES_16_FOR(MAX_BLOCK_SIZE)];
+        block_num_t index_blocks[DATA_BLOCKS_16_FOR(MAX_BLOCK_SIZE)]; // heads only
+      };
     } dirnode;
   } contents;
 };
 
 
-// Function comments for all of these are in jumbo_file_system.c
+// Function comments for all of these are in jumbo_file_system.c.  Every
+// file or directory name they take is a path: names separated by '/',
+// starting from the root directory if the path starts with '/' and from the
+// current directory otherwise.  "." is the directory the path has reached so
+// far and ".." is its parent (the root is its own parent).  They may be
+// called from several threads at once: lookups and reads run side by side,
+// and everything else runs on its own.
+int jfs_mkfs  (const char* filename, uint32_t block_size, uint32_t num_blocks);
 int jfs_mount (const char* filename);
 
+size_t jfs_max_dir_entries();
+size_t jfs_max_data_blocks();
+size_t jfs_max_file_size();
+
 int jfs_mkdir (const char* directory_name);
 int jfs_chdir (const char* directory_name);
-int jfs_ls (char* directories[MAX_DIR_ENTRIES+1], char* files[MAX_DIR_ENTRIES+1]);
+int jfs_ls (char* directories[], char* files[]);
+int jfs_ls_each (int (*fn)(const char* name, int is_dir, void* arg), void* arg);
 int jfs_rmdir (const char* directory_name);
 
 int jfs_creat  (const char* file_name);
@@ -61,7 +192,23 @@ int jfs_remove (const char* file_name);
 int jfs_stat   (const char* name, struct stats* buf);
 int jfs_write  (const char* file_name, const void* buf, unsigned short count);
 int jfs_read   (const char* file_name, void* buf, unsigned short* ptr_count);
-
+int jfs_pwrite (const char* file_name, const void* buf, size_t count, uint64_t offset);
+int jfs_pread  (const char* file_name, void* buf, size_t* ptr_count, uint64_t offset);
+
+int jfs_open   (const char* file_name);
+int jfs_hread  (int handle, void* buf, size_t* ptr_count);
+int jfs_hwrite (int handle, const void* buf, size_t count);
+int64_t jfs_hseek (int handle, int64_t offset, int whence);
+int jfs_close  (int handle);
+
+int jfs_append_open  (const char* file_name);
+int jfs_append       (int handle, const void* buf, size_t count);
+int jfs_append_close (int handle);
+
+int jfs_statfs (struct fs_stats* buf);
+int jfs_batch_begin();
+int jfs_batch_commit();
+int jfs_sync();
 int jfs_unmount();
 
 
@@ -77,5 +224,9 @@ int jfs_unmount();
 #define E_MAX_DIR_ENTRIES -8 // the operation would cause the maximum number of entries in a directory to be exceeded
 #define E_MAX_FILE_SIZE -9   // the operation would cause the maximum file size to be exceeded
 #define E_DISK_FULL -10      // the disk is full (or the operation would require more capacity than remains on the disk)
+#define E_BAD_HANDLE -11     // the file handle is not open
+#define E_MAX_OPEN_FILES -12 // MAX_OPEN_FILES files are open already
+#define E_BAD_OFFSET -13     // the seek would move before the start of the file (or whence is invalid)
+#define E_BAD_PATH -14       // the path names something the operation can't act on (such as removing "..", or the current directory)
 
 #endif // _JUMBO_FILE_SYSTEM_H_
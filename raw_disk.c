@@ -1,13 +1,78 @@
 #include "raw_disk.h"
+#include "async_io.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <string.h>
+
+// POSIX only guarantees 16, but Linux allows 1024 iovecs per call
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 static const char* disk_filename = NULL;
 static int disk_fd = -1;
 
+// geometry of the mounted disk
+static uint32_t disk_block_size = DEFAULT_BLOCK_SIZE;
+static uint32_t disk_num_blocks = DEFAULT_NUM_BLOCKS;
+static uint32_t disk_version = DISK_FORMAT_VERSION; // 0 for a legacy disk
+
+// backend requested for the next raw_mount()
+static enum raw_backend requested_backend = RAW_BACKEND_FD;
+
+// the whole DISK file when it is mapped, or NULL on the fd backend
+static char* disk_map = NULL;
+
+// engine requested for the next raw_mount(), and whether one is running
+static enum raw_async_engine requested_engine = RAW_ASYNC_AUTO;
+static int async_running = 0;
+
+
+// checks that a geometry is one we can format or mount with the given
+// format version
+static int valid_geometry(uint32_t version, uint32_t block_size, uint32_t num_blocks) {
+  if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+      (block_size & (block_size - 1)) != 0) {
+    return 0;
+  }
+  // every block number has to fit in what the format stores on disk
+  uint32_t max_blocks = version >= 2 ? MAX_NUM_BLOCKS : MAX_NUM_BLOCKS_16;
+  // block 0 holds the header, and there must be something left to use
+  return num_blocks >= 2 && num_blocks <= max_blocks;
+}
+
+
+int raw_format(const char* filename, uint32_t block_size, uint32_t num_blocks) {
+  if (!valid_geometry(DISK_FORMAT_VERSION, block_size, num_blocks)) {
+    return -1;
+  }
+
+  int fd = open(filename, O_CREAT|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // size the file in one go; the blocks read back as zeros
+  struct disk_header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = DISK_MAGIC;
+  header.version = DISK_FORMAT_VERSION;
+  header.block_size = block_size;
+  header.num_blocks = num_blocks;
+  if (ftruncate(fd, (off_t)block_size * num_blocks) < 0 ||
+      pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    close(fd);
+    return -1;
+  }
+  return close(fd);
+}
+
 
 int raw_mount(const char* filename) {
   // open file; creat if it doesn't exist already
@@ -16,30 +81,63 @@ int raw_mount(const char* filename) {
     return -1;
   }
 
-  // check the file size
-  off_t file_size = lseek(disk_fd, 0, SEEK_END);
-  if (file_size < 0) {
+  // read the geometry from the header; no header means a legacy disk
+  struct disk_header header;
+  memset(&header, 0, sizeof(header));
+  if (pread(disk_fd, &header, sizeof(header), 0) < 0) {
     close(disk_fd);
     disk_fd = -1;
     return -1;
-
-  } else if (file_size < NUM_BLOCKS * BLOCK_SIZE) {
-    // if the file size is less than it should be, we need to extend it
-    long to_write = NUM_BLOCKS * BLOCK_SIZE - file_size;
-    char* buffer = (char*) malloc(to_write * sizeof(char));
-    // make sure the new allocation writes 0's to the disk
-    for (int i = 0; i < to_write; i++) {
-      buffer[i] = 0;
+  }
+  if (header.magic == DISK_MAGIC) {
+    if (header.version == 0 || header.version > DISK_FORMAT_VERSION ||
+        !valid_geometry(header.version, header.block_size, header.num_blocks)) {
+      // written by a newer version, or not ours after all
+      close(disk_fd);
+      disk_fd = -1;
+      return -1;
     }
+    disk_block_size = header.block_size;
+    disk_num_blocks = header.num_blocks;
+    disk_version = header.version;
+  } else {
+    disk_block_size = LEGACY_BLOCK_SIZE;
+    disk_num_blocks = LEGACY_NUM_BLOCKS;
+    disk_version = 0;
+  }
 
-    // commit the file extension to disk
-    if (write(disk_fd, buffer, to_write) < to_write) {
+  // check the file size
+  struct stat st;
+  if (fstat(disk_fd, &st) < 0) {
+    close(disk_fd);
+    disk_fd = -1;
+    return -1;
+  }
+  off_t disk_size = (off_t)NUM_BLOCKS * BLOCK_SIZE;
+  if (st.st_size < disk_size) {
+    // if the file size is less than it should be, we need to extend it
+    // (the new space reads back as 0's)
+    if (ftruncate(disk_fd, disk_size) < 0) {
       close(disk_fd);
       disk_fd = -1;
-      free(buffer);
       return -1;
     }
-    free(buffer);
+  }
+
+  // map the whole image if asked to; if that fails we just stay on the fd
+  // backend, which works everywhere
+  if (requested_backend == RAW_BACKEND_MMAP) {
+    void* map = mmap(NULL, (size_t)NUM_BLOCKS * BLOCK_SIZE, PROT_READ|PROT_WRITE,
+                     MAP_SHARED, disk_fd, 0);
+    if (map != MAP_FAILED) {
+      disk_map = map;
+    }
+  }
+
+  // a mapped disk has nothing to wait for; otherwise start the async engine,
+  // and if even that fails the submit_* calls just run synchronously
+  if (disk_map == NULL && async_start(disk_fd, requested_engine) == 0) {
+    async_running = 1;
   }
 
   disk_filename = filename;
@@ -47,14 +145,53 @@ int raw_mount(const char* filename) {
 }
 
 
+void raw_set_backend(enum raw_backend backend) {
+  requested_backend = backend;
+}
+
+
+uint32_t raw_block_size() {
+  return disk_block_size;
+}
+
+
+uint32_t raw_num_blocks() {
+  return disk_num_blocks;
+}
+
+
+int raw_is_legacy() {
+  return disk_version == 0;
+}
+
+
+uint32_t raw_format_version() {
+  return disk_version;
+}
+
+
+void raw_set_async_engine(enum raw_async_engine engine) {
+  requested_engine = engine;
+}
+
+
+const void* raw_block_ptr(block_num_t block_num) {
+  if (disk_map == NULL) {
+    return NULL;
+  }
+  return disk_map + (size_t)block_num * BLOCK_SIZE;
+}
+
+
 int read_block(block_num_t block_num, void* buf) {
-  // go to the block
-  if (lseek(disk_fd, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
-    return -1;
+  if (disk_map != NULL) {
+    memcpy(buf, disk_map + (size_t)block_num * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
   }
-  // read the block
-  int ret = read(disk_fd, buf, BLOCK_SIZE);
-  if (ret != BLOCK_SIZE) {
+
+  // read the block at its offset; pread leaves the file offset alone
+  ssize_t ret = pread(disk_fd, buf, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+  if (ret != (ssize_t)BLOCK_SIZE) {
     return -1;
   }
   return 0;
@@ -62,20 +199,132 @@ int read_block(block_num_t block_num, void* buf) {
 
 
 int write_block(block_num_t block_num, void* buf) {
-  // go to the block
-  if (lseek(disk_fd, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
-    return -1;
+  if (disk_map != NULL) {
+    memcpy(disk_map + (size_t)block_num * BLOCK_SIZE, buf, BLOCK_SIZE);
+    return 0;
   }
-  // write the block
-  int ret = write(disk_fd, buf, BLOCK_SIZE);
-  if (ret != BLOCK_SIZE) {
+
+  // write the block at its offset; pwrite leaves the file offset alone
+  ssize_t ret = pwrite(disk_fd, buf, BLOCK_SIZE, (off_t)block_num * BLOCK_SIZE);
+  if (ret != (ssize_t)BLOCK_SIZE) {
     return -1;
   }
   return 0;
 }
 
 
+/* run_length
+ *   counts how many entries starting at block_nums[0] are consecutive block
+ *   numbers, so they can be moved with a single vectored syscall
+ */
+static int run_length(const block_num_t* block_nums, int count) {
+  int len = 1;
+  while (len < count && len < IOV_MAX &&
+         block_nums[len] == block_nums[len - 1] + 1) {
+    len++;
+  }
+  return len;
+}
+
+
+/* transfer_blocks
+ *   shared body of read_blocks() and write_blocks(): issues one preadv or
+ *   pwritev per run of adjacent block numbers
+ */
+static int transfer_blocks(const block_num_t* block_nums, void* const* bufs,
+                           int count, int is_write) {
+  if (disk_map != NULL) {
+    // mapped: every block is just a memcpy away
+    for (int i = 0; i < count; i++) {
+      char* block = disk_map + (size_t)block_nums[i] * BLOCK_SIZE;
+      if (is_write) {
+        memcpy(block, bufs[i], BLOCK_SIZE);
+      } else {
+        memcpy(bufs[i], block, BLOCK_SIZE);
+      }
+    }
+    return 0;
+  }
+
+  struct iovec iov[IOV_MAX];
+  for (int i = 0; i < count; ) {
+    int len = run_length(&block_nums[i], count - i);
+    for (int j = 0; j < len; j++) {
+      iov[j].iov_base = bufs[i + j];
+      iov[j].iov_len = BLOCK_SIZE;
+    }
+
+    off_t offset = (off_t)block_nums[i] * BLOCK_SIZE;
+    ssize_t expected = (ssize_t)len * BLOCK_SIZE;
+    ssize_t ret = is_write ? pwritev(disk_fd, iov, len, offset)
+                           : preadv(disk_fd, iov, len, offset);
+    if (ret != expected) {
+      return -1;
+    }
+    i += len;
+  }
+  return 0;
+}
+
+
+int read_blocks(const block_num_t* block_nums, void* const* bufs, int count) {
+  return transfer_blocks(block_nums, bufs, count, 0);
+}
+
+
+int write_blocks(const block_num_t* block_nums, void* const* bufs, int count) {
+  return transfer_blocks(block_nums, bufs, count, 1);
+}
+
+
+int submit_read_block(block_num_t block_num, void* buf) {
+  if (!async_running) {
+    return read_block(block_num, buf);
+  }
+  return async_queue(block_num, buf, 0);
+}
+
+
+int submit_write_block(block_num_t block_num, void* buf) {
+  if (!async_running) {
+    return write_block(block_num, buf);
+  }
+  return async_queue(block_num, buf, 1);
+}
+
+
+int wait_all() {
+  if (!async_running) {
+    return 0;
+  }
+  return async_wait_all();
+}
+
+
+int raw_sync() {
+  if (disk_map != NULL) {
+    return msync(disk_map, (size_t)NUM_BLOCKS * BLOCK_SIZE, MS_SYNC);
+  }
+  return fdatasync(disk_fd);
+}
+
+
 int raw_unmount() {
+  int ret = 0;
+  if (async_running) {
+    async_stop();
+    async_running = 0;
+  }
+  if (disk_map != NULL) {
+    // flush the mapping before it goes away
+    ret = raw_sync();
+    munmap(disk_map, (size_t)NUM_BLOCKS * BLOCK_SIZE);
+    disk_map = NULL;
+  }
   disk_filename = NULL;
-  return close(disk_fd);
+  if (close(disk_fd) < 0) {
+    return -1;
+  }
+  disk_fd = -1;
+  return ret;
 }
@@ -3,16 +3,122 @@
 
 #include <stdint.h>
 
-#define BLOCK_SIZE 64
-#define NUM_BLOCKS (8 * BLOCK_SIZE)
-
 // block_num_t is the data type for a block number
-// and is a 16-bit unsigned integer
-typedef uint16_t block_num_t;
+// and is a 32-bit unsigned integer (disks of format version 1 and legacy
+// disks store 16-bit block numbers, which jumbo_file_system.c widens)
+typedef uint32_t block_num_t;
+
+// range of block sizes a disk can be formatted with (powers of two only)
+#define MIN_BLOCK_SIZE 64
+#define MAX_BLOCK_SIZE 4096
+
+// most blocks a disk can have (every block number must fit in a block_num_t)
+#define MAX_NUM_BLOCKS UINT32_MAX
+
+// most blocks a disk with 16-bit block numbers can have
+#define MAX_NUM_BLOCKS_16 ((uint32_t)1 << 16)
+
+// geometry of disks without a format header
+#define LEGACY_BLOCK_SIZE 64
+#define LEGACY_NUM_BLOCKS (8 * LEGACY_BLOCK_SIZE)
+
+// geometry of new disks by default (32-bit block numbers make 64-byte nodes
+// too small to be useful, so new disks get bigger blocks)
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_NUM_BLOCKS 4096
+
+// geometry of the mounted disk (read from its format header at mount time)
+#define BLOCK_SIZE (raw_block_size())
+#define NUM_BLOCKS (raw_num_blocks())
+
+// "JFS!" in the first four bytes of the disk; a legacy disk starts with its
+// free bitmap, whose first byte always has the bits of blocks 0 and 1 set,
+// so it can never be mistaken for the magic ('J' has bit 0 clear)
+#define DISK_MAGIC 0x2153464a
+
+// version 1 stores 16-bit block numbers in inodes and directory entries,
+// version 2 (what raw_format() writes) stores 32-bit ones
+#define DISK_FORMAT_VERSION 2
+
+// format header stored at the start of block 0
+struct disk_header {
+  uint32_t magic;      // DISK_MAGIC
+  uint32_t version;    // DISK_FORMAT_VERSION
+  uint32_t block_size; // in bytes
+  uint32_t num_blocks;
+};
+
+// ways raw_mount() can access the DISK file
+enum raw_backend {
+  RAW_BACKEND_FD,   // pread/pwrite on a file descriptor (the default)
+  RAW_BACKEND_MMAP  // the whole file is mapped into memory
+};
+
+
+// engines behind submit_read_block()/submit_write_block()/wait_all()
+enum raw_async_engine {
+  RAW_ASYNC_AUTO,    // io_uring when the kernel has it, else a thread pool
+  RAW_ASYNC_THREADS  // always use the thread pool
+};
 
 
+/* raw_set_backend
+ *   chooses the backend used by the next raw_mount(); if the mmap backend is
+ *   requested but the file can't be mapped, raw_mount() falls back to the fd
+ *   backend
+ */
+void raw_set_backend(enum raw_backend backend);
+
+/* raw_set_async_engine
+ *   chooses the asynchronous I/O engine started by the next raw_mount()
+ */
+void raw_set_async_engine(enum raw_async_engine engine);
+
+/* raw_format
+ *   creates (or overwrites) a disk file with the given geometry: the file is
+ *   sized to hold every block, all blocks are zero, and block 0 starts with
+ *   a format header
+ * filename - the name of the disk file on the _real_ file system
+ * block_size - bytes per block (a power of two in [MIN_BLOCK_SIZE, MAX_BLOCK_SIZE])
+ * num_blocks - number of blocks (at most MAX_NUM_BLOCKS)
+ * (the disk is given the current DISK_FORMAT_VERSION)
+ * returns 0 on success or -1 on failure (including an invalid geometry)
+ */
+int raw_format(const char* filename, uint32_t block_size, uint32_t num_blocks);
+
+/* raw_mount
+ *   opens the disk file (creating it if needed) and reads its geometry from
+ *   the format header; a disk without a header is a legacy disk of
+ *   LEGACY_NUM_BLOCKS blocks of LEGACY_BLOCK_SIZE bytes
+ * returns 0 on success or -1 on failure
+ */
 int raw_mount(const char* filename);
 
+/* raw_block_size / raw_num_blocks
+ *   geometry of the mounted disk (see BLOCK_SIZE and NUM_BLOCKS)
+ */
+uint32_t raw_block_size();
+uint32_t raw_num_blocks();
+
+/* raw_is_legacy
+ *   returns 1 if the mounted disk has no format header, 0 otherwise
+ */
+int raw_is_legacy();
+
+/* raw_format_version
+ *   returns the format version of the mounted disk, or 0 for a legacy disk
+ */
+uint32_t raw_format_version();
+
+/* raw_block_ptr
+ *   borrows a pointer to a block inside the mapped DISK file, so it can be
+ *   read without copying it first
+ * block_num - number of the block
+ * returns a pointer to BLOCK_SIZE bytes that stays valid until raw_unmount(),
+ *   or NULL if the disk isn't mapped (fd backend)
+ */
+const void* raw_block_ptr(block_num_t block_num);
+
 /* read_block
  *   reads a block from the disk
  * block_num - number of the block to read
@@ -31,6 +137,65 @@ int read_block(block_num_t block_num, void* buf);
  */
 int write_block(block_num_t block_num, void* buf);
 
+/* read_blocks
+ *   reads several blocks from the disk; runs of adjacent block numbers are
+ *   read with a single preadv() call
+ * block_nums - numbers of the blocks to read
+ * bufs - bufs[i] receives block block_nums[i]
+ * (precondition: every buffer is BLOCK_SIZE bytes long)
+ * count - number of entries in block_nums and bufs
+ * returns 0 on success or -1 on failure
+ */
+int read_blocks(const block_num_t* block_nums, void* const* bufs, int count);
+
+/* write_blocks
+ *   writes several blocks to the disk; runs of adjacent block numbers are
+ *   written with a single pwritev() call
+ * block_nums - numbers of the blocks to write
+ * bufs - bufs[i] holds the data for block block_nums[i]
+ * (precondition: every buffer is BLOCK_SIZE bytes long)
+ * count - number of entries in block_nums and bufs
+ * returns 0 on success or -1 on failure
+ */
+int write_blocks(const block_num_t* block_nums, void* const* bufs, int count);
+
+/* submit_read_block
+ *   queues a read of one block; the data is only guaranteed to be in buf
+ *   after the next wait_all()
+ * block_num - number of the block to read
+ * buf - data read from disk will be copied into this buffer
+ * (precondition: buf is BLOCK_SIZE bytes long and stays valid until wait_all())
+ * returns 0 on success or -1 on failure
+ */
+int submit_read_block(block_num_t block_num, void* buf);
+
+/* submit_write_block
+ *   queues a write of one block; the write is only guaranteed to have
+ *   happened after the next wait_all()
+ * block_num - number of the block to write
+ * buf - buffer containing the data to write to disk
+ * (precondition: buf is BLOCK_SIZE bytes long and stays valid and unchanged
+ *  until wait_all())
+ * returns 0 on success or -1 on failure
+ */
+int submit_write_block(block_num_t block_num, void* buf);
+
+/* wait_all
+ *   submits every queued read and write in batches (adjacent blocks are
+ *   merged into one request) and waits for all of them to complete.  The
+ *   requests for any one block happen in the order they were queued, so a
+ *   read queued after a write of the same block sees the new data.
+ * returns 0 if every request succeeded or -1 if any of them failed
+ */
+int wait_all();
+
+/* raw_sync
+ *   makes everything written so far durable (msync on the mmap backend,
+ *   fdatasync on the fd backend)
+ * returns 0 on success or -1 on failure
+ */
+int raw_sync();
+
 int raw_unmount();
 
 #endif // _RAW_DISK_H_
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "jumbo_file_system.h"
+
+// A multi-threaded stress benchmark: it runs the same mix of operations with
+// 1, 2, 4, ... threads, up to the number asked for, and reports how many
+// operations per second each count gets through.  Every thread reads the
+// shared files by name and through a handle of its own, looks names up, and
+// now and then rewrites a file of its own, checking everything it reads.
+//
+// usage: stress [max threads] [milliseconds per run] [write percent]
+
+#define DISK_FILENAME "STRESS_DISK"
+#define DISK_BLOCK_SIZE 1024
+#define DISK_NUM_BLOCKS 65536
+
+#define NUM_SHARED_FILES 16
+#define SHARED_FILE_SIZE 65536
+#define READ_SIZE 4096
+#define WRITE_SIZE 8192
+
+// settings for one run, and what its threads got done
+struct run {
+  int num_threads;
+  int write_percent;
+  volatile int stop;
+  uint64_t ops;
+  int failed;
+  pthread_mutex_t lock;
+};
+
+struct worker {
+  struct run* run;
+  int id;
+};
+
+
+// the byte at offset k of shared file f (or of a thread's own file f)
+unsigned char pattern(int f, size_t k) {
+  return (unsigned char)(f * 31 + k * 7 + k / 251);
+}
+
+
+int check(const unsigned char* buf, size_t count, int f, size_t offset) {
+  for (size_t k = 0; k < count; k++) {
+    if (buf[k] != pattern(f, offset + k)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+// one operation of the mix; returns 0 on success or -1 on failure
+int run_op(struct worker* w, int handle, unsigned* seed, unsigned char* buf) {
+  char name[MAX_NAME_LENGTH + 16];
+  int f = rand_r(seed) % NUM_SHARED_FILES;
+  size_t offset = rand_r(seed) % (SHARED_FILE_SIZE - READ_SIZE);
+  size_t count = READ_SIZE;
+  int pick = rand_r(seed) % 100;
+
+  if (pick < w->run->write_percent) {
+    // rewrite this thread's own file, then read it back
+    int mine = 1000 + w->id;
+    sprintf(name, "/stress/t%d", w->id);
+    for (size_t k = 0; k < WRITE_SIZE; k++) {
+      buf[k] = pattern(mine, k);
+    }
+    count = WRITE_SIZE;
+    if (jfs_pwrite(name, buf, WRITE_SIZE, 0) != E_SUCCESS ||
+        jfs_pread(name, buf, &count, 0) != E_SUCCESS || count != WRITE_SIZE) {
+      return -1;
+    }
+    return check(buf, count, mine, 0);
+  }
+
+  pick = rand_r(seed) % 3;
+  if (pick == 0) {
+    sprintf(name, "/stress/f%d", f);
+    if (jfs_pread(name, buf, &count, offset) != E_SUCCESS || count != READ_SIZE) {
+      return -1;
+    }
+    return check(buf, count, f, offset);
+  } else if (pick == 1) {
+    // the thread's handle is always on shared file 0
+    if (jfs_hseek(handle, offset, SEEK_SET) != (int64_t)offset ||
+        jfs_hread(handle, buf, &count) != E_SUCCESS || count != READ_SIZE) {
+      return -1;
+    }
+    return check(buf, count, 0, offset);
+  } else {
+    struct stats st;
+    sprintf(name, "/stress/f%d", f);
+    if (jfs_stat(name, &st) != E_SUCCESS || st.file_size != SHARED_FILE_SIZE) {
+      return -1;
+    }
+    sprintf(name, "/stress/missing%d", f);
+    return (jfs_stat(name, &st) == E_NOT_EXISTS) ? 0 : -1;
+  }
+}
+
+
+void* work(void* arg) {
+  struct worker* w = arg;
+  unsigned seed = w->id * 7919 + 1;
+  unsigned char* buf = malloc(WRITE_SIZE);
+  int handle = jfs_open("/stress/f0");
+  uint64_t ops = 0;
+  int failed = (NULL == buf || handle < 0);
+  while (!failed && !__atomic_load_n(&w->run->stop, __ATOMIC_RELAXED)) {
+    failed = (run_op(w, handle, &seed, buf) != 0);
+    ops++;
+  }
+  if (handle >= 0) {
+    jfs_close(handle);
+  }
+  free(buf);
+
+  pthread_mutex_lock(&w->run->lock);
+  w->run->ops += ops;
+  w->run->failed |= failed;
+  pthread_mutex_unlock(&w->run->lock);
+  return NULL;
+}
+
+
+// runs the mix with run->num_threads threads for ms milliseconds; returns
+// operations per second, or -1 if anything failed
+double run_threads(struct run* run, int ms) {
+  pthread_t threads[run->num_threads];
+  struct worker workers[run->num_threads];
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < run->num_threads; i++) {
+    workers[i].run = run;
+    workers[i].id = i;
+    if (pthread_create(&threads[i], NULL, work, &workers[i]) != 0) {
+      run->num_threads = i;
+      run->failed = 1;
+      break;
+    }
+  }
+  usleep(ms * 1000);
+  __atomic_store_n(&run->stop, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < run->num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (run->failed) {
+    return -1;
+  }
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return run->ops / seconds;
+}
+
+
+// makes the shared files (and one file per thread to rewrite)
+int setup(int max_threads) {
+  char name[MAX_NAME_LENGTH + 16];
+  unsigned char* buf = malloc(SHARED_FILE_SIZE);
+  if (NULL == buf || jfs_mkdir("/stress") != E_SUCCESS) {
+    free(buf);
+    return -1;
+  }
+  int ret = 0;
+  for (int f = 0; f < NUM_SHARED_FILES && ret == 0; f++) {
+    for (size_t k = 0; k < SHARED_FILE_SIZE; k++) {
+      buf[k] = pattern(f, k);
+    }
+    sprintf(name, "/stress/f%d", f);
+    if (jfs_creat(name) != E_SUCCESS ||
+        jfs_pwrite(name, buf, SHARED_FILE_SIZE, 0) != E_SUCCESS) {
+      ret = -1;
+    }
+  }
+  for (int i = 0; i < max_threads && ret == 0; i++) {
+    sprintf(name, "/stress/t%d", i);
+    if (jfs_creat(name) != E_SUCCESS) {
+      ret = -1;
+    }
+  }
+  free(buf);
+  if (ret == 0 && jfs_sync() != E_SUCCESS) {
+    ret = -1;
+  }
+  return ret;
+}
+
+
+int main(int argc, char** argv) {
+  int max_threads = (argc > 1) ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+  int ms = (argc > 2) ? atoi(argv[2]) : 1000;
+  int write_percent = (argc > 3) ? atoi(argv[3]) : 5;
+  if (max_threads > MAX_OPEN_FILES) {
+    // every thread keeps a handle open
+    max_threads = MAX_OPEN_FILES;
+  }
+  if (max_threads < 1 || ms < 1 || write_percent < 0 || write_percent > 100) {
+    printf("usage: %s [max threads] [milliseconds per run] [write percent]\n", argv[0]);
+    return 1;
+  }
+
+  unlink(DISK_FILENAME);
+  if (jfs_mkfs(DISK_FILENAME, DISK_BLOCK_SIZE, DISK_NUM_BLOCKS) != E_SUCCESS ||
+      jfs_mount(DISK_FILENAME) != E_SUCCESS) {
+    printf("can't make and mount %s\n", DISK_FILENAME);
+    return 1;
+  }
+  if (setup(max_threads) != 0) {
+    printf("can't set up the files\n");
+    jfs_unmount();
+    return 1;
+  }
+
+  printf("%d%% writes, %d ms per run\n", write_percent, ms);
+  printf("threads      ops/s  speedup\n");
+  double base = 0;
+  int ret = 0;
+  for (int n = 1; ret == 0; n *= 2) {
+    if (n > max_threads) {
+      // finish with the count asked for, if it isn't a power of two
+      if (n / 2 == max_threads) {
+        break;
+      }
+      n = max_threads;
+    }
+    struct run run = { .num_threads = n, .write_percent = write_percent };
+    pthread_mutex_init(&run.lock, NULL);
+    double rate = run_threads(&run, ms);
+    pthread_mutex_destroy(&run.lock);
+    if (rate < 0) {
+      printf("%7d  failed\n", n);
+      ret = 1;
+    } else {
+      if (n == 1) {
+        base = rate;
+      }
+      printf("%7d %10.0f %7.2fx\n", n, rate, rate / base);
+    }
+    if (n == max_threads) {
+      break;
+    }
+  }
+
+  if (jfs_unmount() != E_SUCCESS) {
+    ret = 1;
+  }
+  unlink(DISK_FILENAME);
+  return ret;
+}